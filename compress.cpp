@@ -0,0 +1,199 @@
+#include "compress.hpp"
+
+#include <cstring>
+
+
+namespace {
+
+
+enum {
+    MIN_MATCH = 4,
+    /* a match doesn't start that close to the end of the block */
+    MATCH_LIMIT = 12,
+    /* the block always ends with that many literals */
+    LAST_LITERALS = 5,
+    MAX_OFFSET = 65535,
+    HASH_LOG = 14
+};
+
+
+inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+
+inline uint32_t hash32(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+
+inline uint8_t *put_length(uint8_t *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = uint8_t(len);
+    return op;
+}
+
+
+uint8_t *put_sequence(
+    uint8_t *op, const uint8_t *literals, size_t num_literals, size_t offset, size_t match_len)
+{
+    uint8_t *token = op++;
+    size_t ml = match_len - MIN_MATCH;
+    *token = uint8_t((num_literals < 15 ? num_literals : 15) << 4 | (ml < 15 ? ml : 15));
+    if (num_literals >= 15) {
+        op = put_length(op, num_literals - 15);
+    }
+    memcpy(op, literals, num_literals);
+    op += num_literals;
+    *op++ = uint8_t(offset);
+    *op++ = uint8_t(offset >> 8);
+    if (ml >= 15) {
+        op = put_length(op, ml - 15);
+    }
+    return op;
+}
+
+
+/* false if the length runs past the end of input */
+inline bool get_length(const uint8_t *&ip, const uint8_t *iend, size_t &len)
+{
+    uint8_t b;
+    do {
+        if (ip == iend) {
+            return false;
+        }
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+
+}
+
+
+size_t lz_compress(const uint8_t *src, size_t size, uint8_t *dst)
+{
+    const uint8_t *ip = src, *anchor = src, *iend = src + size;
+    uint8_t *op = dst;
+
+    if (size > MATCH_LIMIT) {
+        const uint8_t *match_limit = iend - MATCH_LIMIT;
+        const uint8_t *match_end_limit = iend - LAST_LITERALS;
+        uint32_t table[1 << HASH_LOG];
+        memset(table, 0, sizeof table);
+
+        ip++;
+        while (ip < match_limit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash32(seq);
+            const uint8_t *ref = src + table[h];
+            table[h] = uint32_t(ip - src);
+
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+                /* the longer no match is found the faster we move */
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            const uint8_t *match_end = ip + MIN_MATCH;
+            const uint8_t *r = ref + MIN_MATCH;
+            while (match_end < match_end_limit && *match_end == *r) {
+                match_end++;
+                r++;
+            }
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            op = put_sequence(op, anchor, ip - anchor, ip - ref, match_end - ip);
+            ip = anchor = match_end;
+            if (ip - 2 >= src) {
+                table[hash32(read32(ip - 2))] = uint32_t(ip - 2 - src);
+            }
+        }
+    }
+
+    size_t num_literals = iend - anchor;
+    *op++ = uint8_t((num_literals < 15 ? num_literals : 15) << 4);
+    if (num_literals >= 15) {
+        op = put_length(op, num_literals - 15);
+    }
+    memcpy(op, anchor, num_literals);
+    op += num_literals;
+    return op - dst;
+}
+
+
+bool lz_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t dst_size)
+{
+    const uint8_t *ip = src, *iend = src + size;
+    uint8_t *op = dst, *oend = dst + dst_size;
+
+    while (ip != iend) {
+        uint8_t token = *ip++;
+
+        size_t num_literals = token >> 4;
+        if (num_literals == 15 && !get_length(ip, iend, num_literals)) {
+            return false;
+        }
+        if (num_literals > size_t(iend - ip) || num_literals > size_t(oend - op)) {
+            return false;
+        }
+        if (num_literals <= 16 && iend - ip >= 16 && oend - op >= 16) {
+            /* fixed size copy is way cheaper, the excess is overwritten */
+            memcpy(op, ip, 16);
+        } else {
+            memcpy(op, ip, num_literals);
+        }
+        ip += num_literals;
+        op += num_literals;
+
+        /* the last sequence has literals only */
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return false;
+        }
+        size_t offset = ip[0] | size_t(ip[1]) << 8;
+        ip += 2;
+        if (offset == 0 || offset > size_t(op - dst)) {
+            return false;
+        }
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && !get_length(ip, iend, match_len)) {
+            return false;
+        }
+        match_len += MIN_MATCH;
+        if (match_len > size_t(oend - op)) {
+            return false;
+        }
+
+        const uint8_t *ref = op - offset;
+        if (offset >= 16 && match_len <= 16 && oend - op >= 16) {
+            memcpy(op, ref, 16);
+            op += match_len;
+        } else if (offset >= match_len) {
+            memcpy(op, ref, match_len);
+            op += match_len;
+        } else {
+            /* overlapping, the pattern repeats */
+            for (size_t i = 0; i < match_len; i++) {
+                *op++ = *ref++;
+            }
+        }
+    }
+    return op == oend;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+
+/*
+ * Fast LZ77 block codec for transient files.  The encoding is the LZ4
+ * block format (token, literals, 16 bit offset, match length), the
+ * compressor does greedy parsing with a hash table of 4 byte sequences.
+ * No dependencies, no state shared between blocks.
+ */
+
+
+/* The worst case size of compressed data */
+inline size_t lz_compress_bound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+
+/* dst must hold lz_compress_bound(size) bytes; returns compressed size */
+size_t lz_compress(const uint8_t *src, size_t size, uint8_t *dst);
+
+
+/* Returns false unless the data decompresses into exactly dst_size bytes */
+bool lz_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t dst_size);
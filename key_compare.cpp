@@ -0,0 +1,172 @@
+#include "key_compare.hpp"
+#include "util.hpp"
+
+#include <stdexcept>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KEY_COMPARE_X86 1
+#include <immintrin.h>
+#endif
+
+
+static int compare_keys_scalar(const uint8_t *a, const uint8_t *b)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (int i = 0; i < KEY_SIZE; i += 8) {
+        uint64_t x, y;
+        memcpy(&x, a + i, sizeof x);
+        memcpy(&y, b + i, sizeof y);
+        if (x != y) {
+            /* the first differing byte decides */
+            x = __builtin_bswap64(x);
+            y = __builtin_bswap64(y);
+            return x < y ? -1 : 1;
+        }
+    }
+    return 0;
+#else
+    return memcmp(a, b, KEY_SIZE);
+#endif
+}
+
+
+#ifdef KEY_COMPARE_X86
+
+
+/* mask has a bit set for every byte that differs */
+static inline int first_difference(const uint8_t *a, const uint8_t *b, uint64_t mask)
+{
+    if (mask == 0) {
+        return 0;
+    }
+    int i = __builtin_ctzll(mask);
+    return int(a[i]) - int(b[i]);
+}
+
+
+__attribute__((target("sse4.2")))
+static int compare_keys_sse42(const uint8_t *a, const uint8_t *b)
+{
+    uint64_t mask = 0;
+    for (int i = 0; i < KEY_SIZE; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+        uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+        mask |= uint64_t(~eq & 0xffff) << i;
+    }
+    return first_difference(a, b, mask);
+}
+
+
+__attribute__((target("avx2")))
+static int compare_keys_avx2(const uint8_t *a, const uint8_t *b)
+{
+    __m256i x0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a));
+    __m256i y0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b));
+    __m256i x1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + 32));
+    __m256i y1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + 32));
+    uint32_t eq0 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x0, y0));
+    uint32_t eq1 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x1, y1));
+    uint64_t mask = ~(uint64_t(eq1) << 32 | eq0);
+    return first_difference(a, b, mask);
+}
+
+
+__attribute__((target("avx512f,avx512bw")))
+static int compare_keys_avx512(const uint8_t *a, const uint8_t *b)
+{
+    __m512i x = _mm512_loadu_si512(a);
+    __m512i y = _mm512_loadu_si512(b);
+    uint64_t mask = _mm512_cmpneq_epu8_mask(x, y);
+    return first_difference(a, b, mask);
+}
+
+
+#endif
+
+
+namespace {
+
+
+struct key_compare_impl_info
+{
+    const char      *name;
+    key_compare_fn   fn;
+    bool           (*is_supported)();
+};
+
+
+bool always_supported()
+{
+    return true;
+}
+
+
+#ifdef KEY_COMPARE_X86
+bool sse42_supported()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+
+
+bool avx2_supported()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+
+bool avx512_supported()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+#endif
+
+
+/* best first */
+const key_compare_impl_info impls[] = {
+#ifdef KEY_COMPARE_X86
+    { "avx512", compare_keys_avx512, avx512_supported },
+    { "avx2",   compare_keys_avx2,   avx2_supported },
+    { "sse4.2", compare_keys_sse42,  sse42_supported },
+#endif
+    { "scalar", compare_keys_scalar, always_supported }
+};
+
+
+key_compare_fn select_best()
+{
+    for (const auto &impl: impls) {
+        if (impl.is_supported()) {
+            return impl.fn;
+        }
+    }
+    /* scalar is always supported */
+    return compare_keys_scalar;
+}
+
+
+}
+
+
+key_compare_fn key_compare_impl = select_best();
+
+
+void select_key_compare(const char *name)
+{
+    for (const auto &impl: impls) {
+        if (!strcmp(impl.name, name)) {
+            if (!impl.is_supported()) {
+                throw std::runtime_error(
+                    format_message("Key compare implementation not supported by CPU: %s", name));
+            }
+            key_compare_impl = impl.fn;
+            return;
+        }
+    }
+    throw std::runtime_error(
+        format_message("Unknown key compare implementation: %s", name));
+}
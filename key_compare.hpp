@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+
+
+/*
+ * Comparing 64 byte keys (memcmp semantics).  Several implementations
+ * exist (scalar, SSE4.2, AVX2, AVX-512), the best one supported by the
+ * CPU is picked at startup.
+ */
+enum {
+    KEY_SIZE = 64
+};
+
+
+typedef int (*key_compare_fn)(const uint8_t *a, const uint8_t *b);
+
+
+extern key_compare_fn key_compare_impl;
+
+
+inline int compare_keys(const uint8_t *a, const uint8_t *b)
+{
+    return key_compare_impl(a, b);
+}
+
+
+/*
+ * Force a particular implementation (scalar, sse4.2, avx2, avx512).
+ * Throws if the CPU doesn't support it.
+ */
+void select_key_compare(const char *name);
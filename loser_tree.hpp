@@ -0,0 +1,106 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+
+/*
+ * Tournament tree of losers for k-way merging.
+ *
+ * Players are the heads of the input streams (T::operator< compares
+ * them).  Internal nodes keep the loser of the match played in the
+ * node, the overall winner is kept separately.  Once the winner is
+ * advanced to the next record (or exhausted) the matches are replayed
+ * along the path from the winner's leaf to the root, that is log2(k)
+ * comparisons per record, against roughly 2*log2(k) for a binary heap.
+ *
+ * Nodes are plain indices into the players array, the whole tree is a
+ * single small array.  The tree works for any k, not necessarily a
+ * power of 2: leaf i is at k+i, the parent of node n is n/2.
+ *
+ * Exhausted players lose to everyone; once the winner is exhausted the
+ * tree is empty.
+ */
+template <typename T>
+class loser_tree
+{
+    public:
+        loser_tree(std::vector<T> &players_)
+            : players(players_), k(players_.size()), tree(std::max<size_t>(k, 1)),
+              exhausted(k, 0)
+        {
+            if (k) {
+                tree[0] = init(1);
+            }
+        }
+
+        bool empty() const
+        {
+            return k == 0 || exhausted[tree[0]];
+        }
+
+        /* index of the winner */
+        size_t top() const
+        {
+            return tree[0];
+        }
+
+        /* the winner has advanced (or has no more records) */
+        void replay(bool is_exhausted)
+        {
+            uint32_t p = tree[0];
+            exhausted[p] = is_exhausted;
+            for (size_t n = (p + k) / 2; n > 0; n /= 2) {
+                if (beats(tree[n], p)) {
+                    std::swap(tree[n], p);
+                }
+            }
+            tree[0] = p;
+        }
+
+        /*
+         * The best of the others (the winner played with every one of
+         * them or with somebody who did), or nullptr if the rest are
+         * exhausted.  Costs log2(k) comparisons.
+         */
+        const T *runner_up() const
+        {
+            uint32_t r = tree[0];
+            for (size_t n = (tree[0] + k) / 2; n > 0; n /= 2) {
+                if (r == tree[0] || beats(tree[n], r)) {
+                    r = tree[n];
+                }
+            }
+            return r == tree[0] || exhausted[r] ? nullptr : &players[r];
+        }
+
+    private:
+        std::vector<T>         &players;
+        size_t                  k;
+        std::vector<uint32_t>   tree;
+        std::vector<char>       exhausted;
+
+        bool beats(uint32_t a, uint32_t b) const
+        {
+            if (exhausted[a] || exhausted[b]) {
+                return !exhausted[a];
+            }
+            return players[a] < players[b];
+        }
+
+        /* returns the winner of the subtree, keeps losers in the nodes */
+        uint32_t init(size_t n)
+        {
+            if (n >= k) {
+                return n - k;
+            }
+            uint32_t a = init(2 * n), b = init(2 * n + 1);
+            if (beats(b, a)) {
+                std::swap(a, b);
+            }
+            tree[n] = b;
+            return a;
+        }
+};
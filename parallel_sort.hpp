@@ -0,0 +1,270 @@
+#pragma once
+
+#include "util.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <atomic>
+#include <random>
+#include <type_traits>
+#include <vector>
+#include <cstring>
+
+
+/*
+ * In-place parallel samplesort, loosely modelled after IPS4o.
+ *
+ * 1. Splitters are picked from a random sample, the array is going to be
+ *    distributed into 2^k buckets (k is chosen so that there are several
+ *    buckets per thread);
+ *
+ * 2. Each thread classifies its own stripe of the array.  Elements are
+ *    collected in small per-bucket buffers; once a buffer fills up it is
+ *    flushed back into the stripe as a block.  Reading always proceeds
+ *    ahead of writing, hence no data is lost.  This is the part where
+ *    all the comparisons happen, it runs in parallel;
+ *
+ * 3. Blocks are brought together, permuted so that blocks of the same
+ *    bucket are adjacent, shifted into their final positions and
+ *    completed with whatever is left in the buffers.  Data is moved in
+ *    bulk, no comparisons here;
+ *
+ * 4. Buckets are sorted independently in parallel.
+ *
+ * Extra memory is limited to the per-thread buffers (several hundred
+ * KiB each), T is expected to be a small trivially copyable type.
+ */
+template <typename T, typename Compare>
+class parallel_sorter
+{
+    public:
+        enum {
+            BLOCK_SIZE = 256,            /* elements */
+            OVERSAMPLING = 16,
+            LOG_BUCKETS_MAX = 8,
+            BUCKETS_PER_THREAD = 4,
+            MIN_ELEMENTS_PER_THREAD = 64 * 1024
+        };
+
+        static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+
+        parallel_sorter(T *first_, T *last_, unsigned num_threads_, Compare comp_)
+            : first(first_), n(last_ - first_), num_threads(num_threads_), comp(comp_)
+        {
+        }
+
+        void sort()
+        {
+            num_threads = std::min<size_t>(num_threads, n / MIN_ELEMENTS_PER_THREAD);
+            if (num_threads < 2) {
+                std::sort(first, first + n, comp);
+                return;
+            }
+
+            log_buckets = 1;
+            while (log_buckets < LOG_BUCKETS_MAX
+                && (size_t(1) << log_buckets) < num_threads * BUCKETS_PER_THREAD) {
+                log_buckets++;
+            }
+            num_buckets = size_t(1) << log_buckets;
+
+            pick_splitters();
+
+            stripes.resize(num_threads);
+            run_parallel(num_threads, [this](unsigned i) { classify_stripe(i); });
+
+            distribute_blocks();
+
+            run_parallel(num_threads, [this](unsigned) { sort_buckets(); });
+        }
+
+    private:
+        /* per-thread classification state */
+        struct stripe
+        {
+            size_t                 begin, end;
+            std::vector<T>         buf;
+            std::vector<size_t>    buf_fill;
+            std::vector<uint16_t>  block_bucket;
+        };
+
+        T                        *first;
+        size_t                    n;
+        unsigned                  num_threads;
+        Compare                   comp;
+        unsigned                  log_buckets;
+        size_t                    num_buckets;
+        /* implicit search tree, tree[1..num_buckets-1] */
+        std::vector<T>            tree;
+        std::vector<stripe>       stripes;
+        std::vector<size_t>       bucket_start;
+        std::vector<size_t>       bucket_order;
+        std::atomic<size_t>       next_bucket;
+
+        void pick_splitters()
+        {
+            std::vector<T> sample(num_buckets * OVERSAMPLING);
+            std::minstd_rand rng(n);
+            std::uniform_int_distribution<size_t> random_index(0, n - 1);
+            for (auto &e: sample) {
+                e = first[random_index(rng)];
+            }
+            std::sort(sample.begin(), sample.end(), comp);
+
+            tree.resize(num_buckets);
+            size_t i = OVERSAMPLING - 1;
+            build_tree(1, sample, i);
+        }
+
+        /* in-order traversal yields splitters in the ascending order */
+        void build_tree(size_t node, const std::vector<T> &sample, size_t &i)
+        {
+            if (node >= num_buckets) {
+                return;
+            }
+            build_tree(2 * node, sample, i);
+            tree[node] = sample[i];
+            i += OVERSAMPLING;
+            build_tree(2 * node + 1, sample, i);
+        }
+
+        size_t classify(const T &e) const
+        {
+            size_t node = 1;
+            for (unsigned l = 0; l < log_buckets; l++) {
+                node = 2 * node + comp(tree[node], e);
+            }
+            return node - num_buckets;
+        }
+
+        void classify_stripe(unsigned t)
+        {
+            size_t num_blocks = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            size_t stripe_size = (num_blocks + num_threads - 1) / num_threads * BLOCK_SIZE;
+            stripe &s = stripes[t];
+
+            s.begin = std::min(n, t * stripe_size);
+            s.end = std::min(n, s.begin + stripe_size);
+            s.buf.resize(num_buckets * BLOCK_SIZE);
+            s.buf_fill.assign(num_buckets, 0);
+
+            size_t w = s.begin;
+            for (size_t i = s.begin; i != s.end; i++) {
+                size_t b = classify(first[i]);
+                T *buf = s.buf.data() + b * BLOCK_SIZE;
+                buf[s.buf_fill[b]++] = first[i];
+                if (s.buf_fill[b] == BLOCK_SIZE) {
+                    memcpy(first + w, buf, BLOCK_SIZE * sizeof(T));
+                    w += BLOCK_SIZE;
+                    s.block_bucket.push_back(b);
+                    s.buf_fill[b] = 0;
+                }
+            }
+        }
+
+        void distribute_blocks()
+        {
+            /* bring blocks together */
+            std::vector<uint16_t> block_bucket;
+            for (auto &s: stripes) {
+                memmove(
+                    first + block_bucket.size() * BLOCK_SIZE,
+                    first + s.begin,
+                    s.block_bucket.size() * BLOCK_SIZE * sizeof(T));
+                block_bucket.insert(
+                    block_bucket.end(), s.block_bucket.begin(), s.block_bucket.end());
+            }
+
+            std::vector<size_t> num_blocks(num_buckets, 0);
+            for (auto b: block_bucket) {
+                num_blocks[b]++;
+            }
+
+            /* bucket sizes -> bucket and block placement */
+            std::vector<size_t> block_start(num_buckets + 1);
+            bucket_start.resize(num_buckets + 1);
+            block_start[0] = bucket_start[0] = 0;
+            for (size_t b = 0; b < num_buckets; b++) {
+                size_t sz = num_blocks[b] * BLOCK_SIZE;
+                for (auto &s: stripes) {
+                    sz += s.buf_fill[b];
+                }
+                block_start[b + 1] = block_start[b] + num_blocks[b];
+                bucket_start[b + 1] = bucket_start[b] + sz;
+            }
+
+            /* permute blocks, one bucket after another (American flag) */
+            std::vector<size_t> next(block_start.begin(), block_start.end() - 1);
+            std::vector<T> tmp(BLOCK_SIZE);
+            for (size_t b = 0; b < num_buckets; b++) {
+                while (next[b] != block_start[b + 1]) {
+                    size_t dest = block_bucket[next[b]];
+                    if (dest == b) {
+                        next[b]++;
+                        continue;
+                    }
+                    swap_blocks(next[b], next[dest], tmp.data());
+                    std::swap(block_bucket[next[b]], block_bucket[next[dest]]);
+                    next[dest]++;
+                }
+            }
+
+            /* move into final positions; destinations are to the right,
+             * hence going from the last bucket */
+            for (size_t b = num_buckets; b-- > 0; ) {
+                memmove(
+                    first + bucket_start[b],
+                    first + block_start[b] * BLOCK_SIZE,
+                    num_blocks[b] * BLOCK_SIZE * sizeof(T));
+            }
+
+            /* add leftovers */
+            for (size_t b = 0; b < num_buckets; b++) {
+                T *p = first + bucket_start[b] + num_blocks[b] * BLOCK_SIZE;
+                for (auto &s: stripes) {
+                    memcpy(p, s.buf.data() + b * BLOCK_SIZE, s.buf_fill[b] * sizeof(T));
+                    p += s.buf_fill[b];
+                }
+            }
+            stripes.clear();
+
+            /* larger buckets first for better load balancing */
+            bucket_order.resize(num_buckets);
+            for (size_t b = 0; b < num_buckets; b++) {
+                bucket_order[b] = b;
+            }
+            std::sort(bucket_order.begin(), bucket_order.end(), [this](size_t a, size_t b) {
+                return bucket_size(a) > bucket_size(b);
+            });
+            next_bucket = 0;
+        }
+
+        void swap_blocks(size_t i, size_t j, T *tmp)
+        {
+            const size_t sz = BLOCK_SIZE * sizeof(T);
+            memcpy(tmp, first + i * BLOCK_SIZE, sz);
+            memcpy(first + i * BLOCK_SIZE, first + j * BLOCK_SIZE, sz);
+            memcpy(first + j * BLOCK_SIZE, tmp, sz);
+        }
+
+        size_t bucket_size(size_t b) const
+        {
+            return bucket_start[b + 1] - bucket_start[b];
+        }
+
+        void sort_buckets()
+        {
+            size_t i;
+            while ((i = next_bucket++) < num_buckets) {
+                size_t b = bucket_order[i];
+                std::sort(first + bucket_start[b], first + bucket_start[b + 1], comp);
+            }
+        }
+};
+
+
+template <typename T, typename Compare = std::less<T>>
+void parallel_sort(T *first, T *last, unsigned num_threads, Compare comp = Compare())
+{
+    parallel_sorter<T, Compare>(first, last, num_threads, comp).sort();
+}
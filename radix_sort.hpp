@@ -0,0 +1,128 @@
+#pragma once
+
+#include "util.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+
+/*
+ * In-place MSD radix sort (American flag sort).
+ *
+ * T exposes a fixed length prefix of the key byte by byte
+ * (T::RADIX_BYTES, T::radix_byte(i)).  Elements are distributed by the
+ * prefix bytes, one byte per level; once the prefix is exhausted (or a
+ * bucket gets small) the bucket is finished with std::sort relying on
+ * the comparator which takes the rest of the key into account.
+ *
+ * The top level distribution is sequential, the resulting buckets are
+ * sorted in parallel.
+ */
+template <typename T, typename Compare>
+class radix_sorter
+{
+    public:
+        enum {
+            SMALL_BUCKET = 64,
+            MIN_ELEMENTS_PER_THREAD = 64 * 1024
+        };
+
+        radix_sorter(T *first_, T *last_, unsigned num_threads_, Compare comp_)
+            : first(first_), n(last_ - first_), num_threads(num_threads_), comp(comp_)
+        {
+        }
+
+        void sort()
+        {
+            num_threads = std::min<size_t>(num_threads, n / MIN_ELEMENTS_PER_THREAD);
+            if (num_threads < 2) {
+                sort(first, n, 0, comp);
+                return;
+            }
+
+            size_t depth = 0;
+            while (depth < T::RADIX_BYTES && !distribute(first, n, depth, bucket_start)) {
+                depth++;
+            }
+            if (depth == T::RADIX_BYTES) {
+                std::sort(first, first + n, comp);
+                return;
+            }
+
+            std::atomic<size_t> next_bucket(0);
+            run_parallel(num_threads, [&](unsigned) {
+                size_t b;
+                while ((b = next_bucket++) < 256) {
+                    sort(first + bucket_start[b], bucket_start[b + 1] - bucket_start[b], depth + 1, comp);
+                }
+            });
+        }
+
+    private:
+        T          *first;
+        size_t      n;
+        unsigned    num_threads;
+        Compare     comp;
+        size_t      bucket_start[257];
+
+        /*
+         * Permute elements by the byte at the given depth, fill in bucket
+         * boundaries.  Returns false (and leaves the data intact) if all
+         * elements fall in the same bucket.
+         */
+        static bool distribute(T *a, size_t n, size_t depth, size_t *bucket_start)
+        {
+            size_t count[256] = {};
+            for (size_t i = 0; i != n; i++) {
+                count[a[i].radix_byte(depth)]++;
+            }
+
+            size_t next[256];
+            bucket_start[0] = 0;
+            for (size_t b = 0; b < 256; b++) {
+                if (count[b] == n) {
+                    return false;
+                }
+                next[b] = bucket_start[b];
+                bucket_start[b + 1] = bucket_start[b] + count[b];
+            }
+
+            for (size_t b = 0; b < 256; b++) {
+                while (next[b] != bucket_start[b + 1]) {
+                    T v = a[next[b]];
+                    size_t d = v.radix_byte(depth);
+                    while (d != b) {
+                        std::swap(v, a[next[d]++]);
+                        d = v.radix_byte(depth);
+                    }
+                    a[next[b]++] = v;
+                }
+            }
+            return true;
+        }
+
+        static void sort(T *a, size_t n, size_t depth, const Compare &comp)
+        {
+            size_t bucket_start[257];
+            while (n > SMALL_BUCKET && depth < T::RADIX_BYTES) {
+                if (distribute(a, n, depth, bucket_start)) {
+                    for (size_t b = 0; b < 256; b++) {
+                        sort(a + bucket_start[b], bucket_start[b + 1] - bucket_start[b], depth + 1, comp);
+                    }
+                    return;
+                }
+                depth++;
+            }
+            std::sort(a, a + n, comp);
+        }
+};
+
+
+template <typename T, typename Compare = std::less<T>>
+void radix_sort(T *first, T *last, unsigned num_threads, Compare comp = Compare())
+{
+    radix_sorter<T, Compare>(first, last, num_threads, comp).sort();
+}
@@ -1,17 +1,30 @@
 #include "util.hpp"
+#include "compress.hpp"
 
 #include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <exception>
 #include <cerrno>
 #include <cassert>
 #include <cstdarg>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <err.h>
 #include <limits.h>
 
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
 
 inline void assert_alignment_valid(size_t n)
 {
@@ -184,12 +197,31 @@ bool input_file::read(mem_chunk &data)
 }
 
 
+void input_file::will_need(file_pos_t pos, file_size_t size)
+{
+#ifdef POSIX_FADV_WILLNEED
+    /* errors are of no consequence */
+    posix_fadvise(get_fd(), pos, size, POSIX_FADV_WILLNEED);
+#else
+    (void)pos;
+    (void)size;
+#endif
+}
+
+
 output_file::output_file(const file_id_t &id)
     : file_base(id, O_WRONLY|O_CREAT|O_TRUNC)
 {
 }
 
 
+output_file::output_file(const file_id_t &id, file_pos_t offset)
+    : file_base(id, O_WRONLY|O_CREAT)
+{
+    set_file_pos(offset);
+}
+
+
 void output_file::write(const mem_chunk &data)
 {
     uint8_t *p = data.begin(), *e = data.end();
@@ -208,6 +240,55 @@ void output_file::write(const mem_chunk &data)
 }
 
 
+file_size_t output_file::copy_range(input_file &input, file_pos_t input_pos, file_size_t size)
+{
+    file_size_t done = 0;
+#ifdef __linux__
+    bool use_splice = !is_seekable();
+    loff_t off = input_pos;
+    while (done < size) {
+        size_t chunk = std::min<file_size_t>(size - done, 1 * GiB);
+        ssize_t s;
+        if (use_splice) {
+            s = splice(input.get_fd(), &off, get_fd(), NULL, chunk, SPLICE_F_MOVE);
+        } else {
+            /* reflinks on filesystems supporting it */
+            s = copy_file_range(input.get_fd(), &off, get_fd(), NULL, chunk, 0);
+        }
+        if (s > 0) {
+            done += s;
+            pos += s;
+        } else if (s == 0) {
+            break;
+        } else if (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP) {
+            /* not supported for these files */
+            break;
+        } else if (errno != EINTR) {
+            std::string message = format_message_with_errno(
+                errno, "Copying %s to %s",
+                input.get_file_path().c_str(), get_file_path().c_str());
+            throw std::runtime_error(message);
+        }
+    }
+#else
+    (void)input;
+    (void)input_pos;
+    (void)size;
+#endif
+    return done;
+}
+
+
+void output_file::truncate(file_size_t size)
+{
+    if (ftruncate(get_fd(), size) == -1) {
+        std::string message = format_message_with_errno(
+            errno, "Truncating %s", get_file_path().c_str());
+        throw std::runtime_error(message);
+    }
+}
+
+
 void output_file::flush()
 {
     while (fsync(get_fd()) == -1) {
@@ -228,15 +309,239 @@ void output_file::flush()
 }
 
 
-render_buf::render_buf(const mem_chunk &mem_, const file_id_t &id)
-    : f(id), mem(mem_.aligned()), data(mem.sub_chunk(0, 0))
+/*
+ * Background writer thread.  Chunks are written in the order of
+ * submission, submit() returns a sequence number one can wait() for.
+ */
+class render_buf::writer
+{
+    public:
+        writer(const std::function<void (const mem_chunk &)> &write_fn_)
+            : write_fn(write_fn_), submitted(0), completed(0), closed(false),
+              thread(&writer::run, this)
+        {
+        }
+        ~writer()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                closed = true;
+                cond.notify_all();
+            }
+            thread.join();
+        }
+        uint64_t submit(const mem_chunk &chunk)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            check_error();
+            pending.push_back(chunk);
+            cond.notify_all();
+            return ++submitted;
+        }
+        void wait(uint64_t seq)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this, seq]() { return completed >= seq || error; });
+            check_error();
+        }
+    private:
+        std::function<void (const mem_chunk &)>  write_fn;
+        std::mutex               mutex;
+        std::condition_variable  cond;
+        std::deque<mem_chunk>    pending;
+        uint64_t                 submitted, completed;
+        bool                     closed;
+        std::exception_ptr       error;
+        std::thread              thread;
+
+        void check_error()
+        {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                cond.wait(lock, [this]() { return closed || !pending.empty(); });
+                if (pending.empty()) {
+                    return;
+                }
+                mem_chunk chunk = pending.front();
+                pending.pop_front();
+                if (!error) {
+                    lock.unlock();
+                    try {
+                        write_fn(chunk);
+                    }
+                    catch (...) {
+                        lock.lock();
+                        error = std::current_exception();
+                        lock.unlock();
+                    }
+                    lock.lock();
+                }
+                completed++;
+                cond.notify_all();
+            }
+        }
+};
+
+
+struct block_header
+{
+    uint32_t  raw_size;
+    /* 0 if stored uncompressed */
+    uint32_t  packed_size;
+};
+
+
+/*
+ * Block compression, see compressed_blocks.  Full blocks are written as
+ * soon as the data is there, the last one is written by finish().
+ */
+class render_buf::compressor
+{
+    public:
+        compressor(output_file &f_, compressed_blocks &blocks_)
+            : f(f_), blocks(blocks_),
+              packed(sizeof(block_header) + lz_compress_bound(compressed_blocks::BLOCK_SIZE))
+        {
+            staged.reserve(compressed_blocks::BLOCK_SIZE);
+        }
+        void write(const mem_chunk &chunk)
+        {
+            const size_t block_size = compressed_blocks::BLOCK_SIZE;
+            mem_chunk rest = chunk;
+            while (!rest.empty()) {
+                if (staged.empty() && rest.size() >= block_size) {
+                    write_block(rest.begin(), block_size);
+                    rest = rest.sub_chunk(block_size, -1);
+                    continue;
+                }
+                size_t n = std::min(rest.size(), block_size - staged.size());
+                staged.insert(staged.end(), rest.begin(), rest.begin() + n);
+                rest = rest.sub_chunk(n, -1);
+                if (staged.size() == block_size) {
+                    write_block(staged.data(), staged.size());
+                    staged.clear();
+                }
+            }
+        }
+        void finish()
+        {
+            if (!staged.empty()) {
+                write_block(staged.data(), staged.size());
+                staged.clear();
+            }
+            blocks.pos.push_back(f.get_file_pos());
+        }
+    private:
+        output_file           &f;
+        compressed_blocks     &blocks;
+        std::vector<uint8_t>   staged;
+        std::vector<uint8_t>   packed;
+
+        void write_block(const uint8_t *p, size_t size)
+        {
+            blocks.pos.push_back(f.get_file_pos());
+
+            block_header hd;
+            hd.raw_size = size;
+            size_t packed_size = lz_compress(p, size, packed.data() + sizeof hd);
+            if (packed_size < size) {
+                hd.packed_size = packed_size;
+                memcpy(packed.data(), &hd, sizeof hd);
+                f.write(mem_chunk(packed.data(), sizeof hd + packed_size));
+            } else {
+                /* incompressible */
+                hd.packed_size = 0;
+                f.write(mem_chunk(&hd, sizeof hd));
+                f.write(mem_chunk(const_cast<uint8_t *>(p), size));
+            }
+        }
+};
+
+
+render_buf::render_buf(
+    const mem_chunk &mem_, const file_id_t &id, unsigned num_buffers, compressed_blocks *blocks)
+    : f(id), mem(mem_.aligned()), data(mem.sub_chunk(0, 0)), pos(0), cur_buffer(0),
+      is_copy_range_supported(true)
+{
+    if (id) {
+        if (blocks) {
+            comp.reset(new compressor(f, *blocks));
+        }
+        init_buffers(num_buffers);
+    }
+}
+
+
+render_buf::render_buf(
+    const mem_chunk &mem_, const file_id_t &id, file_pos_t offset, unsigned num_buffers)
+    : f(id, offset), mem(mem_.aligned()), pos(offset), cur_buffer(0),
+      is_copy_range_supported(true)
+{
+    init_buffers(num_buffers);
+    /* to keep memory/file alignment in sync */
+    data = mem.sub_chunk(static_cast<size_t>(offset & (mem_chunk::ALIGNMENT_MAX - 1)), 0);
+}
+
+
+void render_buf::init_buffers(unsigned num_buffers)
+{
+    if (num_buffers > 1) {
+        size_t buffer_size = mem.size() / num_buffers & ~(mem_chunk::ALIGNMENT_MAX - 1);
+        if (buffer_size != 0) {
+            for (unsigned i = 0; i < num_buffers; i++) {
+                buffers.push_back(mem.sub_chunk(i * buffer_size, buffer_size));
+            }
+            buffer_seq.assign(num_buffers, 0);
+            mem = buffers[0];
+            data = mem.sub_chunk(0, 0);
+            bg.reset(new writer([this](const mem_chunk &chunk) { write_out(chunk); }));
+        }
+    }
+}
+
+
+render_buf::~render_buf()
+{
+}
+
+
+/* runs on the writer thread with write-behind */
+void render_buf::write_out(const mem_chunk &chunk)
+{
+    if (comp) {
+        comp->write(chunk);
+    } else {
+        f.write(chunk);
+    }
+}
+
+
+void render_buf::write_data()
 {
+    if (bg) {
+        buffer_seq[cur_buffer] = bg->submit(data);
+    } else {
+        write_out(data);
+    }
+    pos += data.size();
 }
 
 
 void render_buf::flush()
 {
-    f.write(data);
+    write_data();
+    if (bg) {
+        bg->wait(buffer_seq[cur_buffer]);
+    }
+    if (comp) {
+        comp->finish();
+    }
     /* to keep memory/file alignment in sync */
     data = data.sub_chunk(data.size(), -1);
     f.flush();
@@ -247,7 +552,12 @@ mem_chunk render_buf::get_free_mem()
 {
     mem_chunk free_mem = mem.sub_chunk(data.end() - mem.begin(), -1);
     if (free_mem.empty()) {
-        f.write(data);
+        write_data();
+        if (bg) {
+            cur_buffer = (cur_buffer + 1) % buffers.size();
+            bg->wait(buffer_seq[cur_buffer]);
+            mem = buffers[cur_buffer];
+        }
         data = mem.sub_chunk(0, 0);
         free_mem = mem;
     }
@@ -270,6 +580,27 @@ void *render_buf::write(const mem_chunk &bytes_)
 }
 
 
+file_size_t render_buf::copy_range(input_file &input, file_pos_t input_pos, file_size_t size)
+{
+    /* a range smaller than the buffer costs less copied through it,
+     * output stays batched */
+    if (!is_copy_range_supported || comp || size < mem.size()) {
+        return 0;
+    }
+    /* data buffered goes first */
+    write_data();
+    if (bg) {
+        bg->wait(buffer_seq[cur_buffer]);
+    }
+    file_size_t done = f.copy_range(input, input_pos, size);
+    is_copy_range_supported = (done == size);
+    pos += done;
+    /* to keep memory/file alignment in sync */
+    data = mem.sub_chunk(static_cast<size_t>(pos & (mem_chunk::ALIGNMENT_MAX - 1)), 0);
+    return done;
+}
+
+
 void render_buf::skip(size_t num_bytes)
 {
     while (num_bytes > 0) {
@@ -290,9 +621,272 @@ void render_buf::align(size_t n)
 }
 
 
-parse_buf::parse_buf(const mem_chunk &mem_, const file_id_t &id)
-    : f(id), mem(mem_.aligned())
+/*
+ * Loading the next chunk of a file in a thread pool, a single load is
+ * in flight at a time.
+ */
+class parse_buf::reader
+{
+    public:
+        reader(parse_buf &buf_, thread_pool &pool_)
+            : buf(buf_), pool(pool_), is_pending(false), is_done(false)
+        {
+        }
+        ~reader()
+        {
+            if (is_pending) {
+                try {
+                    wait();
+                }
+                catch (...) {
+                }
+            }
+        }
+        bool is_busy() const { return is_pending; }
+        void start(const mem_chunk &chunk)
+        {
+            is_pending = true;
+            pool.submit([this, chunk]() {
+                mem_chunk data = chunk;
+                std::exception_ptr e;
+                try {
+                    buf.load(data);
+                }
+                catch (...) {
+                    e = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                result = data;
+                error = e;
+                is_done = true;
+                cond.notify_all();
+            });
+        }
+        mem_chunk wait()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this]() { return is_done; });
+            is_pending = is_done = false;
+            if (error) {
+                std::exception_ptr e = error;
+                error = nullptr;
+                std::rethrow_exception(e);
+            }
+            return result;
+        }
+    private:
+        parse_buf               &buf;
+        thread_pool             &pool;
+        std::mutex               mutex;
+        std::condition_variable  cond;
+        bool                     is_pending, is_done;
+        mem_chunk                result;
+        std::exception_ptr       error;
+};
+
+
+parse_buf::parse_buf(
+    const mem_chunk &mem_, const file_id_t &id, thread_pool *read_ahead,
+    std::shared_ptr<const compressed_blocks> blocks_)
+    : f(id), data_end(0), load_pos(0), blocks(blocks_), cur_buffer(0),
+      pool(nullptr), is_loading(false), is_eof(false)
+{
+    mem_chunk mem = mem_.aligned();
+    size_t buffer_size = mem.size() / 2 & ~(mem_chunk::ALIGNMENT_MAX - 1);
+    size_t min_buffer_size = blocks ? compressed_blocks::BLOCK_SIZE + mem_chunk::ALIGNMENT_MAX : 1;
+    if (read_ahead && buffer_size >= min_buffer_size) {
+        buffers[0] = mem.sub_chunk(0, buffer_size);
+        buffers[1] = mem.sub_chunk(buffer_size, buffer_size);
+        bg.reset(new reader(*this, *read_ahead));
+    } else {
+        buffers[0] = mem;
+    }
+    data = buffers[0].sub_chunk(0, 0);
+}
+
+
+parse_buf::parse_buf(
+    const mem_chunk &mem, const file_id_t &id, prefetch_pool &pool_,
+    prefetch_pool::forecast_fn forecast_, std::shared_ptr<const compressed_blocks> blocks_)
+    : f(id), data_end(0), load_pos(0), blocks(blocks_), cur_buffer(0),
+      pool(&pool_), forecast(forecast_), is_loading(false), is_eof(false)
+{
+    buffers[0] = mem.aligned();
+    data = buffers[0].sub_chunk(0, 0);
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->streams.push_back(this);
+}
+
+
+parse_buf::~parse_buf()
+{
+    if (!pool) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->cond.wait(lock, [this]() { return !is_loading; });
+    for (auto &r: ready) {
+        pool->free_blocks.push_back(r.block);
+    }
+    if (!borrowed.empty()) {
+        pool->free_blocks.push_back(borrowed);
+    }
+    pool->streams.erase(std::find(pool->streams.begin(), pool->streams.end(), this));
+}
+
+
+/* runs in the thread pool with read-ahead */
+void parse_buf::load(mem_chunk &chunk)
+{
+    if (!blocks) {
+        f.read(chunk);
+        load_pos += chunk.size();
+        return;
+    }
+
+    /* as many whole blocks as fit */
+    const size_t block_size = compressed_blocks::BLOCK_SIZE;
+    if (chunk.size() < block_size) {
+        throw std::runtime_error("Not enough memory to read compressed data");
+    }
+    size_t size = 0;
+    while (chunk.size() - size >= block_size) {
+        block_header hd;
+        mem_chunk c(&hd, sizeof hd);
+        if (!f.read(c)) {
+            break;
+        }
+        if (c.size() != sizeof hd
+            || hd.raw_size > block_size
+            || hd.packed_size > lz_compress_bound(block_size)) {
+            throw std::runtime_error(
+                format_message("Data corrupt in %s", f.get_file_path().c_str()));
+        }
+
+        uint8_t *p = chunk.begin() + size;
+        bool ok;
+        if (hd.packed_size == 0) {
+            c = mem_chunk(p, hd.raw_size);
+            ok = f.read(c) && c.size() == hd.raw_size;
+        } else {
+            packed.resize(hd.packed_size);
+            c = mem_chunk(packed.data(), hd.packed_size);
+            ok = f.read(c) && c.size() == hd.packed_size
+                && lz_decompress(packed.data(), hd.packed_size, p, hd.raw_size);
+        }
+        if (!ok) {
+            throw std::runtime_error(
+                format_message("Data corrupt in %s", f.get_file_path().c_str()));
+        }
+
+        size += hd.raw_size;
+        if (hd.raw_size != block_size) {
+            /* the last one */
+            break;
+        }
+    }
+    chunk = chunk.sub_chunk(0, size);
+    load_pos += size;
+}
+
+
+bool parse_buf::fill()
+{
+    if (pool) {
+        return fill_pooled();
+    }
+    if (bg && bg->is_busy()) {
+        cur_buffer ^= 1;
+        data = bg->wait();
+    } else {
+        /* to keep memory/file alignment in sync */
+        data = buffers[cur_buffer].sub_chunk(
+            static_cast<size_t>(data_end & (mem_chunk::ALIGNMENT_MAX - 1)), -1);
+        load(data);
+    }
+    data_end = load_pos;
+    if (data.empty()) {
+        return false;
+    }
+    if (bg) {
+        bg->start(buffers[cur_buffer ^ 1].sub_chunk(
+            static_cast<size_t>(data_end & (mem_chunk::ALIGNMENT_MAX - 1)), -1));
+    }
+    return true;
+}
+
+
+bool parse_buf::fill_pooled()
+{
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    if (!borrowed.empty()) {
+        pool->free_blocks.push_back(borrowed);
+        borrowed = mem_chunk();
+    }
+    pool->cond.wait(lock, [this]() { return !ready.empty() || !is_loading; });
+    if (load_error) {
+        std::exception_ptr e = load_error;
+        load_error = nullptr;
+        std::rethrow_exception(e);
+    }
+    if (!ready.empty()) {
+        borrowed = ready.front().block;
+        data = ready.front().data;
+        data_end = ready.front().data_end;
+        ready.pop_front();
+    } else if (!is_eof) {
+        /* forecast wrong (or the pool is short of blocks), read right away */
+        is_loading = true;
+        lock.unlock();
+        mem_chunk chunk = buffers[0].sub_chunk(
+            static_cast<size_t>(load_pos & (mem_chunk::ALIGNMENT_MAX - 1)), -1);
+        try {
+            load(chunk);
+        } catch (...) {
+            lock.lock();
+            is_loading = false;
+            pool->cond.notify_all();
+            throw;
+        }
+        lock.lock();
+        is_loading = false;
+        pool->cond.notify_all();
+        is_eof = chunk.empty();
+        data = chunk;
+        data_end = load_pos;
+    }
+    pool->schedule(lock);
+    return !data.empty();
+}
+
+
+/* runs in the thread pool (or in the caller) with the pool unlocked */
+void parse_buf::prefetch(const mem_chunk &block)
 {
+    prefetch_pool *p = pool;
+    mem_chunk chunk = block.sub_chunk(
+        static_cast<size_t>(load_pos & (mem_chunk::ALIGNMENT_MAX - 1)), -1);
+    std::exception_ptr e;
+    try {
+        load(chunk);
+    } catch (...) {
+        e = std::current_exception();
+    }
+    std::unique_lock<std::mutex> lock(p->mutex);
+    is_loading = false;
+    if (e) {
+        load_error = e;
+        p->free_blocks.push_back(block);
+    } else if (chunk.empty()) {
+        is_eof = true;
+        p->free_blocks.push_back(block);
+    } else {
+        ready.push_back(prefetched{block, chunk, load_pos});
+    }
+    p->cond.notify_all();
+    if (p->io) {
+        p->schedule(lock);
+    }
 }
 
 
@@ -300,13 +894,8 @@ bool parse_buf::read(mem_chunk &bytes_)
 {
     mem_chunk bytes = bytes_.sub_chunk(0, 0);
     while (bytes.size() < bytes_.size()) {
-        if (data.empty()) {
-            /* to keep memory/file alignment in sync */
-            data = mem.sub_chunk(
-                static_cast<size_t>(f.get_file_pos() & (mem_chunk::ALIGNMENT_MAX - 1)), -1);
-            if (!f.read(data)) {
-                break;
-            }
+        if (data.empty() && !fill()) {
+            break;
         }
         mem_chunk read_portion;
         data.split_at(bytes_.size() - bytes.size(), read_portion, data);
@@ -321,10 +910,45 @@ void parse_buf::skip(size_t num_bytes)
 {
     if (num_bytes <= data.size()) {
         data = data.sub_chunk(num_bytes, -1);
+        return;
+    }
+
+    if (pool) {
+        /* blocks are loaded ahead in order, seeking is out of question */
+        do {
+            num_bytes -= data.size();
+            data = data.sub_chunk(data.size(), 0);
+            if (!fill()) {
+                return;
+            }
+        } while (num_bytes > data.size());
+        data = data.sub_chunk(num_bytes, -1);
+        return;
+    }
+
+    file_pos_t new_pos = data_end + (num_bytes - data.size());
+    if (bg && bg->is_busy()) {
+        /* data read ahead is of no use */
+        bg->wait();
+    }
+
+    /* compressed data is read by blocks, the one containing new_pos
+     * is loaded and the bytes preceding new_pos are dropped */
+    file_pos_t load_from = new_pos;
+    if (blocks) {
+        size_t i = new_pos / compressed_blocks::BLOCK_SIZE;
+        load_from = file_pos_t(i) * compressed_blocks::BLOCK_SIZE;
+        /* the last entry is the end of file */
+        f.set_file_pos(blocks->pos[std::min(i, blocks->pos.size() - 1)]);
     } else {
-        num_bytes -= data.size();
-        data = mem_chunk();
-        f.set_file_pos(f.get_file_pos() + num_bytes);
+        f.set_file_pos(new_pos);
+    }
+    load_pos = data_end = load_from;
+    /* to keep memory/file alignment in sync */
+    data = buffers[cur_buffer].sub_chunk(
+        static_cast<size_t>(load_from & (mem_chunk::ALIGNMENT_MAX - 1)), 0);
+    if (new_pos != load_from && fill()) {
+        data = data.sub_chunk(new_pos - load_from, -1);
     }
 }
 
@@ -338,6 +962,233 @@ void parse_buf::align(size_t n)
 }
 
 
+prefetch_pool::prefetch_pool(
+    const mem_chunk &mem_, size_t block_size, thread_pool *io_, key_less_fn key_less_)
+    : is_started(false), io(io_), key_less(key_less_)
+{
+    mem_chunk mem = mem_.aligned();
+    /* to keep blocks aligned */
+    block_size &= ~size_t(mem_chunk::ALIGNMENT_MAX - 1);
+    while (block_size && mem.size() >= block_size) {
+        mem_chunk block;
+        mem.split_at(block_size, block, mem);
+        free_blocks.push_back(block);
+    }
+}
+
+
+void prefetch_pool::start()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    is_started = true;
+    schedule(lock);
+}
+
+
+/* free blocks go to the streams forecast to run dry first */
+void prefetch_pool::schedule(std::unique_lock<std::mutex> &lock)
+{
+    while (is_started && !free_blocks.empty()) {
+        parse_buf *next = nullptr;
+        const uint8_t *next_key = nullptr;
+        for (parse_buf *s: streams) {
+            if (s->is_loading || s->is_eof || s->load_error) {
+                continue;
+            }
+            const uint8_t *key = s->forecast(s->load_pos);
+            if (key && (!next || key_less(key, next_key))) {
+                next = s;
+                next_key = key;
+            }
+        }
+        if (!next) {
+            return;
+        }
+        mem_chunk block = free_blocks.back();
+        free_blocks.pop_back();
+        next->is_loading = true;
+        if (io) {
+            io->submit([next, block]() { next->prefetch(block); });
+        } else {
+            lock.unlock();
+            next->prefetch(block);
+            lock.lock();
+        }
+    }
+}
+
+
+thread_pool::thread_pool(unsigned num_threads)
+{
+    for (unsigned i = 0; i < num_threads; i++) {
+        threads.emplace_back([this]() {
+            std::function<void ()> job;
+            while (jobs.pop(job)) {
+                job();
+            }
+        });
+    }
+}
+
+
+thread_pool::~thread_pool()
+{
+    jobs.close();
+    for (auto &t: threads) {
+        t.join();
+    }
+}
+
+
+void run_parallel(unsigned num_threads, const std::function<void (unsigned)> &fn)
+{
+    std::vector<std::exception_ptr> errors(num_threads);
+    std::vector<std::thread> threads;
+
+    auto invoke = [&](unsigned i)
+    {
+        try {
+            fn(i);
+        }
+        catch (...) {
+            errors[i] = std::current_exception();
+        }
+    };
+
+    try {
+        for (unsigned i = 1; i < num_threads; i++) {
+            threads.emplace_back(invoke, i);
+        }
+    }
+    catch (...) {
+        /* can't just leave, the threads we've got refer to the locals */
+        for (auto &t: threads) {
+            t.join();
+        }
+        throw;
+    }
+
+    invoke(0);
+
+    for (auto &t: threads) {
+        t.join();
+    }
+    for (auto &e: errors) {
+        if (e) {
+            std::rethrow_exception(e);
+        }
+    }
+}
+
+
+size_t get_open_files_limit()
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur == RLIM_INFINITY) {
+        return SIZE_MAX;
+    }
+    return rl.rlim_cur;
+}
+
+
+#ifdef __linux__
+
+
+/* "0-3,8-11\n" */
+static std::vector<int> parse_id_list(const char *path)
+{
+    std::vector<int> ids;
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return ids;
+    }
+    int first, last;
+    while (fscanf(f, "%d", &first) == 1) {
+        last = first;
+        int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%d", &last) != 1) {
+                break;
+            }
+            c = fgetc(f);
+        }
+        for (int i = first; i <= last; i++) {
+            ids.push_back(i);
+        }
+        if (c != ',') {
+            break;
+        }
+    }
+    fclose(f);
+    return ids;
+}
+
+
+std::vector<numa_node> get_numa_nodes()
+{
+    std::vector<numa_node> nodes;
+    for (int id: parse_id_list("/sys/devices/system/node/online")) {
+        numa_node node;
+        node.id = id;
+        node.cpus = parse_id_list(
+            format_message("/sys/devices/system/node/node%d/cpulist", id).c_str());
+        if (!node.cpus.empty()) {
+            nodes.push_back(node);
+        }
+    }
+    return nodes;
+}
+
+
+void bind_to_numa_node(const mem_chunk &mem, const numa_node &node)
+{
+    enum { MPOL_PREFERRED_ = 1 };
+    const size_t bits = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> mask(node.id / bits + 1, 0);
+    mask[node.id / bits] |= 1UL << (node.id % bits);
+    if (syscall(
+            SYS_mbind, mem.begin(), mem.size(), MPOL_PREFERRED_,
+            mask.data(), mask.size() * bits, 0) == -1) {
+        warn("mbind (node %d)", node.id);
+    }
+}
+
+
+void pin_thread_to_numa_node(const numa_node &node)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu: node.cpus) {
+        CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof set, &set) == -1) {
+        warn("sched_setaffinity (node %d)", node.id);
+    }
+}
+
+
+#else
+
+
+std::vector<numa_node> get_numa_nodes()
+{
+    return std::vector<numa_node>();
+}
+
+
+void bind_to_numa_node(const mem_chunk &, const numa_node &)
+{
+}
+
+
+void pin_thread_to_numa_node(const numa_node &)
+{
+}
+
+
+#endif
+
+
 struct vasprintf_utility
 {
     char *message;
@@ -2,6 +2,16 @@
 
 #include <memory>
 #include <string>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <stdexcept>
+#include <exception>
+#include <algorithm>
+#include <cstring>
 #include <cstdint>
 
 
@@ -14,6 +24,77 @@ std::string format_message(const char *fmt, ...);
 std::string format_message_with_errno(int error, const char *fmt, ...);
 
 
+/*
+ * Invoke fn(0) .. fn(num_threads-1) concurrently, fn(0) on the calling
+ * thread.  Returns once all of them are done; an exception thrown by
+ * any of the invocations is rethrown in the caller.
+ */
+void run_parallel(unsigned num_threads, const std::function<void (unsigned)> &fn);
+
+
+/* The limit on open files (RLIMIT_NOFILE), SIZE_MAX if there's none */
+size_t get_open_files_limit();
+
+
+/*
+ * Hands items over from producer thread(s) to consumer thread(s).  Once
+ * closed the queue accepts no more items (they are silently dropped),
+ * pop() drains the remaining ones and returns false afterwards.
+ */
+template <typename T>
+class blocking_queue
+{
+    public:
+        blocking_queue(): closed(false) { ; }
+        void push(T v)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!closed) {
+                items.push_back(std::move(v));
+                cond.notify_one();
+            }
+        }
+        bool pop(T &v)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this]() { return closed || !items.empty(); });
+            if (items.empty()) {
+                return false;
+            }
+            v = std::move(items.front());
+            items.pop_front();
+            return true;
+        }
+        void close()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            cond.notify_all();
+        }
+    private:
+        std::mutex               mutex;
+        std::condition_variable  cond;
+        std::deque<T>            items;
+        bool                     closed;
+};
+
+
+/*
+ * A fixed number of threads running jobs in the order of submission.
+ * Jobs are expected not to throw.  Pending jobs are completed in dtor.
+ */
+class thread_pool
+{
+    public:
+        thread_pool(unsigned num_threads);
+        ~thread_pool();
+        void submit(std::function<void ()> job) { jobs.push(std::move(job)); }
+    private:
+        blocking_queue<std::function<void ()>>  jobs;
+        std::vector<std::thread>                threads;
+};
+
+
 typedef uint64_t file_pos_t, file_size_t;
 
 
@@ -91,6 +172,24 @@ class mem_chunk
 };
 
 
+/*
+ * NUMA topology (Linux only, elsewhere no nodes are reported).  Nodes
+ * without CPUs are ignored.  Binding and pinning are best effort.
+ */
+struct numa_node
+{
+    int               id;
+    std::vector<int>  cpus;
+};
+
+
+std::vector<numa_node> get_numa_nodes();
+/* Prefer allocating pages of the memory range on the node */
+void bind_to_numa_node(const mem_chunk &mem, const numa_node &node);
+/* Run the calling thread (and threads it creates later) on the node's CPUs */
+void pin_thread_to_numa_node(const numa_node &node);
+
+
 /*
  * The base class for input_/output_file classes.  Our IO classes throw
  * exceptions on IO error.  File doesn't need to be seekable though an
@@ -127,6 +226,11 @@ class input_file: public file_base
         /* Reads data in memory and updates size. Returns false iff
          * resulting size==0  (EOF) */
         bool read(mem_chunk &data);
+        /* Hint the OS that the range is going to be read soon, the data
+         * is fetched in background (best effort) */
+        void will_need(file_pos_t pos, file_size_t size);
+    private:
+        friend class output_file;
 };
 
 
@@ -134,13 +238,40 @@ class output_file: public file_base
 {
     public:
         output_file(const file_id_t &id);
+        /* Writing at the offset, the file is not truncated */
+        output_file(const file_id_t &id, file_pos_t offset);
         void write(const mem_chunk &data);
+        /* Copies a range of the input file in kernel (copy_file_range,
+         * splice if the output is a pipe).  Returns the number of bytes
+         * copied, less than requested if the kernel can't do it or the
+         * input is over */
+        file_size_t copy_range(input_file &input, file_pos_t input_pos, file_size_t size);
+        /* Sets the file size (ftruncate) */
+        void truncate(file_size_t size);
         /* Explicit flushing helps to avoid IO errors from close() in
          * file_base dtor */
         void flush();
 };
 
 
+/*
+ * Optional block compression of (transient) files.  The data is cut
+ * into blocks of BLOCK_SIZE bytes (the last one is shorter), every block
+ * is compressed independently (see compress.hpp).  render_buf and
+ * parse_buf users see file positions in the uncompressed data; pos
+ * lists where the blocks start in the file (plus the end of file), which
+ * allows seeking.
+ */
+struct compressed_blocks
+{
+    enum {
+        BLOCK_SIZE = 256 * KiB
+    };
+
+    std::vector<file_pos_t>  pos;
+};
+
+
 /*
  * Controls some aspect of T representation produced by
  * render_buf::put<T> and consumed by parse_buf::get<T>.
@@ -156,17 +287,41 @@ struct repr_traits
 };
 
 
-/* Producing output data  (memory buffer + optional output file) */
+/*
+ * Producing output data  (memory buffer + optional output file).
+ *
+ * With num_buffers > 1 the memory is split into that many buffers;
+ * once a buffer fills up it is written by a background thread while
+ * the next one is being filled (write-behind).
+ *
+ * Several render_bufs may write disjoint ranges of the same file, each
+ * starting at the offset given.
+ */
 class render_buf
 {
     public:
-        render_buf(const mem_chunk &mem, const file_id_t &output_file_id = file_id_t());
+        /* with blocks given the data is compressed, flush() ends it */
+        render_buf(
+            const mem_chunk &mem,
+            const file_id_t &output_file_id = file_id_t(),
+            unsigned num_buffers = 1,
+            compressed_blocks *blocks = nullptr);
+        render_buf(
+            const mem_chunk &mem,
+            const file_id_t &output_file_id,
+            file_pos_t offset,
+            unsigned num_buffers);
+        ~render_buf();
         void flush();
         mem_chunk get_free_mem();
         void *write(const mem_chunk &data);
         void skip(size_t num_bytes);
         void align(size_t n);
-        file_pos_t get_file_pos() const { return f.get_file_pos() + data.size(); }
+        file_pos_t get_file_pos() const { return pos + data.size(); }
+        /* Appends a range of the input file bypassing the memory buffer
+         * where possible (ranges at least the buffer size); returns the
+         * number of bytes appended, the rest is up to the caller */
+        file_size_t copy_range(input_file &input, file_pos_t input_pos, file_size_t size);
 
         template <typename T>
         T *put(const T &v)
@@ -181,21 +336,102 @@ class render_buf
         void put(const mem_chunk &) = delete;
 
     private:
+        class writer;
+        class compressor;
+
         output_file     f;
         mem_chunk       mem;
         mem_chunk       data;
+        /* file position of data.begin() */
+        file_pos_t      pos;
+
+        std::unique_ptr<compressor>  comp;
+
+        /* write-behind */
+        std::vector<mem_chunk>   buffers;
+        std::vector<uint64_t>    buffer_seq;
+        size_t                   cur_buffer;
+        std::unique_ptr<writer>  bg;
+
+        bool                     is_copy_range_supported;
+
+        void init_buffers(unsigned num_buffers);
+        void write_out(const mem_chunk &chunk);
+        void write_data();
+};
+
+
+/*
+ * Consuming input data  (memory buffer + input file).
+ *
+ * With a thread pool given the memory is split into two buffers; the
+ * next one is filled in the pool while the current one is being
+ * consumed (read-ahead).
+ *
+ * Compressed data (blocks given) takes a buffer of at least a block.
+ */
+class parse_buf;
+
+
+/*
+ * Forecasting (Knuth, TAOCP 5.4.6): parse_bufs merged together share a
+ * pool of blocks read ahead.  The stream to run dry first is the one
+ * whose first record not loaded yet has the smallest key; a free block
+ * goes to that stream.  A parse_buf has a single block of its own,
+ * hence way more streams are merged in the same memory while reads
+ * stay a block large.
+ *
+ * Keys are up to the caller: forecast(pos) is the key of the record at
+ * (or around) pos or NULL if no data follows; key_less compares keys.
+ * Blocks are loaded in the thread pool if given, otherwise by the
+ * caller once a stream runs dry.  Streams go before the pool.
+ */
+class prefetch_pool
+{
+    public:
+        typedef std::function<const uint8_t *(file_pos_t)> forecast_fn;
+        typedef std::function<bool (const uint8_t *, const uint8_t *)> key_less_fn;
+
+        prefetch_pool(
+            const mem_chunk &mem, size_t block_size, thread_pool *io, key_less_fn key_less);
+        /* blocks are handed out once all the streams are there */
+        void start();
+
+    private:
+        friend class parse_buf;
+
+        bool                       is_started;
+        thread_pool               *io;
+        key_less_fn                key_less;
+        std::mutex                 mutex;
+        std::condition_variable    cond;
+        std::vector<mem_chunk>     free_blocks;
+        std::vector<parse_buf *>   streams;
+
+        void schedule(std::unique_lock<std::mutex> &lock);
 };
 
 
-/* Consuming input data  (memory buffer + input file) */
 class parse_buf
 {
     public:
-        parse_buf(const mem_chunk &mem, const file_id_t &input_file_id);
+        parse_buf(
+            const mem_chunk &mem,
+            const file_id_t &input_file_id,
+            thread_pool *read_ahead = nullptr,
+            std::shared_ptr<const compressed_blocks> blocks = nullptr);
+        /* a stream in the pool, mem is the block of its own */
+        parse_buf(
+            const mem_chunk &mem,
+            const file_id_t &input_file_id,
+            prefetch_pool &pool,
+            prefetch_pool::forecast_fn forecast,
+            std::shared_ptr<const compressed_blocks> blocks = nullptr);
+        ~parse_buf();
         bool read(mem_chunk &bytes);
         void skip(size_t num_bytes);
         void align(size_t n);
-        file_pos_t get_file_pos() const { return f.get_file_pos() - data.size(); }
+        file_pos_t get_file_pos() const { return data_end - data.size(); }
 
         template <typename T>
         bool get(T &v)
@@ -210,9 +446,42 @@ class parse_buf
         void get(mem_chunk &) = delete;
 
     private:
+        class reader;
+        friend class prefetch_pool;
+
         input_file      f;
-        mem_chunk       mem;
         mem_chunk       data;
+        /* file position of data.end() */
+        file_pos_t      data_end;
+        /* file position of the data load() gets next */
+        file_pos_t      load_pos;
+
+        std::shared_ptr<const compressed_blocks>  blocks;
+        std::vector<uint8_t>                      packed;
+
+        /* read-ahead */
+        mem_chunk                buffers[2];
+        unsigned                 cur_buffer;
+        std::unique_ptr<reader>  bg;
+
+        /* forecasting, the state is guarded by pool->mutex */
+        struct prefetched
+        {
+            mem_chunk   block, data;
+            file_pos_t  data_end;
+        };
+        prefetch_pool               *pool;
+        prefetch_pool::forecast_fn   forecast;
+        std::deque<prefetched>       ready;
+        /* the pool block data is in */
+        mem_chunk                    borrowed;
+        bool                         is_loading, is_eof;
+        std::exception_ptr           load_error;
+
+        void load(mem_chunk &chunk);
+        bool fill();
+        bool fill_pooled();
+        void prefetch(const mem_chunk &block);
 };
 
 
@@ -222,11 +491,27 @@ template <typename header_t, typename external_header_t = header_t>
 class parser
 {
     public:
+        /* start_pos is expected to be the start of a record */
+        parser(
+            const mem_chunk &mem,
+            const file_id_t &input_file_id,
+            file_pos_t start_pos = 0,
+            thread_pool *read_ahead = nullptr,
+            std::shared_ptr<const compressed_blocks> blocks = nullptr
+        )
+            : buf(mem, input_file_id, read_ahead, blocks), hd_valid(false), body_bytes_left(0)
+        {
+            buf.skip(start_pos);
+            parse_next();
+        }
         parser(
             const mem_chunk &mem,
-            const file_id_t &input_file_id
+            const file_id_t &input_file_id,
+            prefetch_pool &pool,
+            prefetch_pool::forecast_fn forecast,
+            std::shared_ptr<const compressed_blocks> blocks = nullptr
         )
-            : buf(mem, input_file_id), hd_valid(false), body_bytes_left(0)
+            : buf(mem, input_file_id, pool, forecast, blocks), hd_valid(false), body_bytes_left(0)
         {
             parse_next();
         }
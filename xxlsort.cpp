@@ -1,18 +1,75 @@
 #include "util.hpp"
+#include "parallel_sort.hpp"
+#include "radix_sort.hpp"
+#include "loser_tree.hpp"
+#include "key_compare.hpp"
 
 #include <sys/mman.h>
+#include <err.h>
 
 #include <cstdlib>
 #include <cstddef>
+#include <cstring>
 #include <memory>
 #include <deque>
+#include <map>
 #include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
 #include <stdexcept>
 #include <cstdio>
 #include <cerrno>
 #include <cinttypes>
 
 
+/*
+ * Tunables (see get_sort_options())
+ */
+enum sort_engine
+{
+    SORT_ENGINE_SAMPLESORT,
+    SORT_ENGINE_RADIX
+};
+
+
+enum huge_pages_mode
+{
+    HUGE_PAGES_NONE,
+    HUGE_PAGES_TRANSPARENT,
+    HUGE_PAGES_2M,
+    HUGE_PAGES_1G
+};
+
+
+enum run_formation_method
+{
+    RUN_FORMATION_SEGMENTS,
+    RUN_FORMATION_REPLACEMENT_SELECTION
+};
+
+
+struct sort_options
+{
+    sort_engine           engine;
+    run_formation_method  run_formation;
+    huge_pages_mode       huge_pages;
+    unsigned              num_threads;
+    unsigned              split_pipeline_depth;
+    bool                  numa;
+    unsigned              write_buffers;
+    unsigned              merge_threads;
+    unsigned              read_ahead_threads;
+    file_size_t           look_ahead;
+    bool                  compress_runs;
+    bool                  separate_bodies;
+    bool                  key_pointers;
+    /* set once the arena is allocated, hugetlb pages can't be moved
+     * between nodes */
+    bool                  hugetlb_arena;
+};
+
+
 /*
  * Public header format
  */
@@ -45,6 +102,9 @@ struct alignas(64) record_header2 {
     uint64_t       crc;
     file_size_t    body_size;
     file_pos_t     body_pos;
+    /* unless the body is present, body_pos is in the input file (0) or
+     * in a body file of the run (1-based, see run_file::body_files) */
+    uint32_t       body_file;
     uint8_t        is_body_present;
     uint8_t        body[1];
 };
@@ -67,7 +127,7 @@ bool parse_header(parse_buf &buf, record_header &external_hd, record_header2 &hd
     if (!buf.get(external_hd)) {
         return false;
     }
-    if (external_hd.body_size > 100 * MiB) {
+    if (external_hd.body_size > 1 * GiB) {
         throw std::runtime_error("Malformed data");
     }
     memcpy(hd.key, external_hd.key, sizeof(record_header::key));
@@ -75,25 +135,215 @@ bool parse_header(parse_buf &buf, record_header &external_hd, record_header2 &hd
     hd.crc = external_hd.crc;
     hd.body_size = external_hd.body_size;
     hd.body_pos = buf.get_file_pos();
+    hd.body_file = 0;
     hd.is_body_present = 1;
     body_size = hd.body_size;
     return true;
 }
 
 
-/* Used by parser<record_header2> */
-bool parse_header(parse_buf &buf, record_header2 &external_hd, record_header2 &hd, file_size_t &body_size)
+/*
+ * Compact encoding of record_header2 in runs, no alignment padding:
+ *
+ *   size             - the number of bytes following (1 byte)
+ *   shared           - key bytes shared with the previous record (1 byte)
+ *   suffix_size      - key bytes following (1 byte), the rest is zeros
+ *   suffix
+ *   is_body_present  - 1 byte
+ *   flags, body_size - varints
+ *   crc              - 8 bytes
+ *   body_pos, body_file - varints, unless the body is present
+ *
+ * Sorted keys tend to share long prefixes; the key is front-coded
+ * against the previous one.  Records with shared == 0 are restart
+ * points, parsing may start there.
+ */
+struct compact_record_header
+{
+    enum {
+        MAX_SIZE = 3 + sizeof(record_header2::key) + 1 + 3 * 10 + 8 + 5
+    };
+
+    /* returns the number of bytes written */
+    static size_t encode(const record_header2 &hd, size_t shared, uint8_t *out)
+    {
+        size_t key_size = sizeof hd.key;
+        while (key_size > shared && hd.key[key_size - 1] == 0) {
+            key_size--;
+        }
+        shared = std::min(shared, key_size);
+
+        uint8_t *p = out + 1;
+        *p++ = shared;
+        *p++ = key_size - shared;
+        memcpy(p, hd.key + shared, key_size - shared);
+        p += key_size - shared;
+        *p++ = hd.is_body_present;
+        put_varint(p, hd.flags);
+        put_varint(p, hd.body_size);
+        memcpy(p, &hd.crc, sizeof hd.crc);
+        p += sizeof hd.crc;
+        if (!hd.is_body_present) {
+            put_varint(p, hd.body_pos);
+            put_varint(p, hd.body_file);
+        }
+        out[0] = p - out - 1;
+        return p - out;
+    }
+
+    /* hd holds the previous record; false if data is malformed */
+    static bool decode(const uint8_t *p, const uint8_t *e, record_header2 &hd)
+    {
+        if (e - p < 3) {
+            return false;
+        }
+        size_t shared = *p++, suffix_size = *p++;
+        if (shared + suffix_size > sizeof hd.key || size_t(e - p) < suffix_size + 1) {
+            return false;
+        }
+        memcpy(hd.key + shared, p, suffix_size);
+        memset(hd.key + shared + suffix_size, 0, sizeof hd.key - shared - suffix_size);
+        p += suffix_size;
+        hd.is_body_present = *p++;
+        uint64_t body_file = 0;
+        if (!get_varint(p, e, hd.flags) || !get_varint(p, e, hd.body_size)
+            || size_t(e - p) < sizeof hd.crc) {
+            return false;
+        }
+        memcpy(&hd.crc, p, sizeof hd.crc);
+        p += sizeof hd.crc;
+        hd.body_pos = 0;
+        if (!hd.is_body_present
+            && (!get_varint(p, e, hd.body_pos) || !get_varint(p, e, body_file))) {
+            return false;
+        }
+        hd.body_file = body_file;
+        return p == e;
+    }
+
+    static void put_varint(uint8_t *&p, uint64_t v)
+    {
+        while (v >= 0x80) {
+            *p++ = uint8_t(v) | 0x80;
+            v >>= 7;
+        }
+        *p++ = uint8_t(v);
+    }
+
+    static bool get_varint(const uint8_t *&p, const uint8_t *e, uint64_t &v)
+    {
+        v = 0;
+        for (unsigned shift = 0; p != e && shift < 64; shift += 7) {
+            uint8_t b = *p++;
+            v |= uint64_t(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+
+/* Used by run_parser */
+bool parse_header(
+    parse_buf &buf, compact_record_header &external_hd, record_header2 &hd, file_size_t &body_size)
 {
-    if (!buf.get(hd)) {
+    uint8_t size;
+    mem_chunk c(&size, 1);
+    if (!buf.read(c)) {
         return false;
     }
+    uint8_t data[compact_record_header::MAX_SIZE];
+    c = mem_chunk(data, size);
+    if (size > sizeof data || !buf.read(c) || c.size() != size
+        || !compact_record_header::decode(data, data + size, hd)) {
+        throw std::runtime_error("Data corrupt");
+    }
     body_size = (hd.is_body_present ? hd.body_size : 0);
     return true;
 }
 
 
+typedef parser<record_header2, compact_record_header> run_parser;
+
+
+/*
+ * Files the bodies not present in record_header2 are fetched from: the
+ * input file or body files (body_file is 1-based in the list).  Body
+ * files are opened on demand, at most max_open at a time (the one
+ * opened first is closed to make room).  The streams of a merge pass
+ * share a body_source, hence the number of descriptors doesn't grow
+ * with the number of runs the bodies came from.
+ */
+class body_source
+{
+    public:
+        body_source(
+            input_file &input_,
+            const std::vector<file_id_t> &body_files_ = std::vector<file_id_t>(),
+            size_t max_open_ = SIZE_MAX)
+            : input(input_), max_open(std::max<size_t>(1, max_open_))
+        {
+            for (const file_id_t &id: body_files_) {
+                body_files.push_back(id);
+                numbers[id.get()] = body_files.size();
+            }
+            opened.resize(body_files.size());
+        }
+        /*
+         * Appends body files of a run, those already there (the spool is
+         * in every run) are not repeated.  Returns the map of the run's
+         * body_file numbers to the numbers here (NULL if the run has no
+         * body files), valid while the body_source is.
+         */
+        const uint32_t *add(const std::vector<file_id_t> &files)
+        {
+            if (files.empty()) {
+                return nullptr;
+            }
+            maps.push_back(std::vector<uint32_t>());
+            for (const file_id_t &id: files) {
+                uint32_t &n = numbers[id.get()];
+                if (n == 0) {
+                    body_files.push_back(id);
+                    n = body_files.size();
+                }
+                maps.back().push_back(n);
+            }
+            opened.resize(body_files.size());
+            return maps.back().data();
+        }
+        const std::vector<file_id_t> &get_files() const { return body_files; }
+        input_file &get(const record_header2 &hd)
+        {
+            if (hd.body_file == 0) {
+                return input;
+            }
+            std::unique_ptr<input_file> &f = opened[hd.body_file - 1];
+            if (!f) {
+                if (open_order.size() == max_open) {
+                    opened[open_order.front()].reset();
+                    open_order.pop_front();
+                }
+                f.reset(new input_file(body_files[hd.body_file - 1]));
+                open_order.push_back(hd.body_file - 1);
+            }
+            return *f;
+        }
+    private:
+        input_file                                &input;
+        size_t                                     max_open;
+        std::vector<file_id_t>                     body_files;
+        std::vector<std::unique_ptr<input_file>>   opened;
+        std::deque<uint32_t>                       open_order;
+        std::map<const file_id *, uint32_t>        numbers;
+        std::deque<std::vector<uint32_t>>          maps;
+};
+
+
 /* convert record_header2 -> record_header and fetch external body */
-void export_record(const record_header2 &hd2, render_buf &output, input_file &input)
+void export_record(const record_header2 &hd2, render_buf &output, body_source &bodies)
 {
     record_header hd;
     memcpy(hd.key, hd2.key, sizeof(record_header::key));
@@ -103,8 +353,10 @@ void export_record(const record_header2 &hd2, render_buf &output, input_file &in
     output.put(hd);
 
     if (!hd2.is_body_present) {
-        input.set_file_pos(hd2.body_pos);
-        file_size_t sz = hd2.body_size;
+        input_file &input = bodies.get(hd2);
+        file_size_t copied = output.copy_range(input, hd2.body_pos, hd2.body_size);
+        input.set_file_pos(hd2.body_pos + copied);
+        file_size_t sz = hd2.body_size - copied;
         while (sz != 0) {
             mem_chunk buf = output.get_free_mem().sub_chunk(0, std::min<file_size_t>(sz, SIZE_MAX));
             if (!input.read(buf)) {
@@ -121,6 +373,79 @@ void export_record(const record_header2 &hd2, render_buf &output, input_file &in
 }
 
 
+/*
+ * Externalized bodies (left in the input file) of the records about to
+ * be exported are requested ahead of time: the OS is hinted to read
+ * them in background, export finds them in the page cache then.  The
+ * amount requested and not yet exported is limited by the window.
+ */
+class body_look_ahead
+{
+    public:
+        body_look_ahead(file_size_t window_)
+            : window(window_), pending(0)
+        {
+        }
+        /* returns false (nothing requested) if the window is full; with
+         * no window at all nothing is requested and nothing is held */
+        bool request(const record_header2 &hd, body_source &bodies)
+        {
+            if (hd.is_body_present || window == 0) {
+                return true;
+            }
+            if (pending != 0 && pending + hd.body_size > window) {
+                return false;
+            }
+            bodies.get(hd).will_need(hd.body_pos, hd.body_size);
+            pending += hd.body_size;
+            return true;
+        }
+        /* the record requested was exported */
+        void release(const record_header2 &hd)
+        {
+            if (!hd.is_body_present && window != 0) {
+                pending -= hd.body_size;
+            }
+        }
+    private:
+        file_size_t   window;
+        file_size_t   pending;
+};
+
+
+/*
+ * Large bodies of a non-seekable input can't be left there; they are
+ * written to a temporary file once instead (mem is the copy buffer) and
+ * referred to the same way.  The spool is the body file 1 of every run
+ * (see run_output).
+ */
+class body_spool
+{
+    public:
+        body_spool(const mem_chunk &mem_)
+            : id(file_id::create_temporary("yndx-xxlsort")), f(id), mem(mem_)
+        {
+        }
+        /* moves the body of the current record to the spool */
+        void store(parser<record_header2, record_header> &input, record_header2 &hd)
+        {
+            hd.body_pos = f.get_file_pos();
+            hd.body_file = 1;
+            hd.is_body_present = 0;
+            mem_chunk buf = mem;
+            while (input.read_body(buf)) {
+                f.write(buf);
+                buf = mem;
+            }
+        }
+        const file_id_t &get_file_id() const { return id; }
+    private:
+        file_id_t    id;
+        output_file  f;
+        mem_chunk    mem;
+};
+
+
 /*
  * In split and sort phase we are sorting a portion of input data in
  * memory. The portion is as large as available memory permits. Normally
@@ -134,256 +459,1550 @@ void export_record(const record_header2 &hd2, render_buf &output, input_file &in
  *
  * Finally to allow for a larger prefix while keeping the size of
  * the structure unchanged an offset is stored instead of a pointer.
+ * The offset counts 64 byte units from the base of the memory arena; 4
+ * bytes cover 256 GiB, a wide variant with a 5 byte offset (and a byte
+ * shorter prefix) is used for larger arenas (up to 64 TiB).
  */
-class sort_element
+class sort_element_base
+{
+    public:
+        static void *base;
+};
+
+
+void *sort_element_base::base;
+
+
+template <size_t OFFSET_SIZE>
+class basic_sort_element: public sort_element_base
 {
     public:
-        static void init(sort_element &i, record_header2 *p)
+        enum {
+            PREFIX_SIZE = 16 - OFFSET_SIZE,
+            PREFIX_OFFSET_MAX = sizeof(record_header::key) - PREFIX_SIZE,
+            RADIX_BYTES = PREFIX_SIZE
+        };
+
+        /* the largest arena addressable */
+        static uint64_t get_max_arena_size() { return uint64_t(64) << (8 * OFFSET_SIZE); }
+
+        static void init(basic_sort_element &i, record_header2 *p)
         {
             memcpy(i.prefix, p->key, sizeof i.prefix);
-            i.offset = (reinterpret_cast<uintptr_t>(p) - reinterpret_cast<uintptr_t>(base)) / 64;
+            i.relocate(p);
         }
-        bool operator < (const sort_element &other) const
+        bool operator < (const basic_sort_element &other) const
         {
             int s = memcmp(prefix, other.prefix, sizeof prefix);
             if (s!=0) {
                 return s < 0;
             } else {
-                return memcmp(
-                    get_header().key + sizeof prefix,
-                    other.get_header().key + sizeof prefix,
-                    sizeof(record_header::key) - sizeof prefix) < 0;
+                /* keys share the bytes preceding the prefix (if any) */
+                return compare_keys(get_header().key, other.get_header().key) < 0;
             }
         }
+        /*
+         * All keys of a segment often share a common prefix; the prefix
+         * stored is then taken at the offset of the first distinguishing
+         * byte instead.  Elements being compared must agree on the offset.
+         */
+        void set_prefix_offset(size_t offset)
+        {
+            memcpy(prefix, get_header().key + offset, sizeof prefix);
+        }
         const record_header2 &get_header() const
         {
+            /* little endian */
+            uint64_t units = 0;
+            memcpy(&units, offset, sizeof offset);
             return *reinterpret_cast<record_header2 *>(
-                reinterpret_cast<uintptr_t>(base) + uintptr_t(offset) * 64);
+                reinterpret_cast<uintptr_t>(base) + uintptr_t(units) * 64);
         }
         mem_chunk get_body() const
         {
             record_header2 &hd = const_cast<record_header2 &>(get_header());
             return mem_chunk(hd.body, hd.is_body_present ? hd.body_size : 0);
         }
+        uint8_t radix_byte(size_t i) const { return prefix[i]; }
+        /* the record was moved */
+        void relocate(record_header2 *p)
+        {
+            uint64_t units = (reinterpret_cast<uintptr_t>(p) - reinterpret_cast<uintptr_t>(base)) / 64;
+            memcpy(offset, &units, sizeof offset);
+        }
     private:
-        uint8_t    prefix[12];
-        uint32_t   offset;
-    public:
-        static void *base;
+        uint8_t    prefix[PREFIX_SIZE];
+        uint8_t    offset[OFFSET_SIZE];
 };
 
 
-void *sort_element::base;
+typedef basic_sort_element<4> sort_element;
+typedef basic_sort_element<5> wide_sort_element;
 
 
-void split_and_sort(
-    const mem_chunk &available_mem_,
-    const file_id_t &src_file,
-    const file_id_t &dest_file,
-    std::deque<file_id_t> &transient_files)
+static_assert(sizeof(sort_element) == 16, "sort_element size");
+static_assert(sizeof(wide_sort_element) == 16, "wide_sort_element size");
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "sort_element offset is little endian");
+
+
+template <typename element_t>
+void sort_elements(const sort_options &options, element_t *vb, element_t *ve)
 {
-    mem_chunk input_mem;
-    mem_chunk available_mem;
-    available_mem_.split_at(4 * MiB, input_mem, available_mem);
+    switch (options.engine) {
+    case SORT_ENGINE_SAMPLESORT:
+        parallel_sort(vb, ve, options.num_threads);
+        break;
+    case SORT_ENGINE_RADIX:
+        radix_sort(vb, ve, options.num_threads);
+        break;
+    }
+}
 
-    parser<record_header2, record_header> input(input_mem, src_file);
-    input_file input2(src_file);
-    file_size_t threshold = input2.is_seekable() ? 1 * MiB : -1;
 
-    int segment_no = 0;
+/*
+ * When everything fits in memory the sorted data goes straight to the
+ * destination in the public format (record_header)
+ */
+template <typename element_t>
+void export_sorted(
+    const sort_options &options,
+    const element_t *vb,
+    const element_t *ve,
+    const mem_chunk &output_mem,
+    const file_id_t &dest_file,
+    body_source &bodies)
+{
+    render_buf output(output_mem, dest_file, options.write_buffers);
+    body_look_ahead look_ahead(options.look_ahead);
+    const element_t *next = vb;
+    for (const element_t *i = vb; i != ve; i++) {
+        while (next != ve && look_ahead.request(next->get_header(), bodies)) {
+            next++;
+        }
+        export_record(i->get_header(), output, bodies);
+        output.write(i->get_body());
+        look_ahead.release(i->get_header());
+    }
+    output.flush();
+}
 
-    do {
-        mem_chunk output_mem;
-        mem_chunk membuf_mem;
 
-        available_mem.split_at(25 * MiB, output_mem, membuf_mem);
+/*
+ * A sorted run in a transient file (private extended format in the
+ * compact encoding, see compact_record_header).
+ *
+ * Every RUN_INDEX_STEP bytes or so a record makes it into the sparse
+ * index: the key, the record position in the file and the position in
+ * the public format (as if the run alone were exported).  The index
+ * allows to start reading a run at a given key.
+ */
+struct run_index_entry
+{
+    uint8_t        key[64];
+    file_pos_t     pos;
+    file_pos_t     export_pos;
+};
 
-        render_buf   membuf(membuf_mem);
-        sort_element   *vb, *ve;
 
-        vb = ve = reinterpret_cast<sort_element *>(membuf.get_free_mem().end());
+class run_file
+{
+    public:
+        enum {
+            RUN_INDEX_STEP = 1 * MiB
+        };
 
-        /*
-         * Memory layout:
-         *
-         * DATA DATA DATA .... DATA -> FREE FREE FREE .... FREE <- P P P .... P
-         */
-        while (input.is_header_valid()) {
-            size_t available_sz = membuf.get_free_mem().size();
-            size_t reserved_sz = (ve - vb + 1)*(sizeof *vb);
-            size_t body_sz;
-            record_header2 hd = input.get_header();
-
-            if (hd.body_size >= threshold) {
-                hd.is_body_present = 0;
-                body_sz = 0;
+        run_file(const file_id_t &id_, bool is_compressed)
+            : id(id_), size(0), export_size(0), next_index_pos(0)
+        {
+            if (is_compressed) {
+                blocks = std::make_shared<compressed_blocks>();
+            }
+        }
+        /* writes the header of the next record (compact_record_header),
+         * the body goes next */
+        void put_header(render_buf &output, const record_header2 &hd)
+        {
+            file_pos_t pos = output.get_file_pos();
+            size_t shared = 0;
+            if (pos >= next_index_pos) {
+                /* a restart point */
+                run_index_entry e;
+                memcpy(e.key, hd.key, sizeof e.key);
+                e.pos = pos;
+                e.export_pos = export_size;
+                index.push_back(e);
+                next_index_pos = pos + RUN_INDEX_STEP;
             } else {
-                body_sz = hd.body_size;
+                while (shared < sizeof last_key && hd.key[shared] == last_key[shared]) {
+                    shared++;
+                }
             }
+            uint8_t data[compact_record_header::MAX_SIZE];
+            size_t data_size = compact_record_header::encode(hd, shared, data);
+            output.write(mem_chunk(data, data_size));
+            memcpy(last_key, hd.key, sizeof last_key);
 
-            if (available_sz < alignof(hd) + sizeof(hd) + body_sz + reserved_sz) {
-                break;
-            }
+            size = pos + data_size + (hd.is_body_present ? hd.body_size : 0);
+            export_size += repr_traits<record_header>::SIZE + hd.body_size;
+        }
 
-            membuf.align(alignof(hd));
-            sort_element::init(*(--vb), membuf.put(hd));
+        file_id_t                     id;
+        /* null unless the run is compressed */
+        std::shared_ptr<compressed_blocks>  blocks;
+        /* files holding bodies of the run records (see run_output) */
+        std::vector<file_id_t>        body_files;
+        /* a resident run (see run_writer::write_resident) has no file,
+         * sorted records are in memory instead, taking mem */
+        const record_header2 * const *records = nullptr;
+        const record_header2 * const *records_end = nullptr;
+        mem_chunk                     mem;
+        std::vector<run_index_entry>  index;
+        file_size_t                   size;
+        /* the size in the public format */
+        file_size_t                   export_size;
+    private:
+        file_pos_t                    next_index_pos;
+        uint8_t                       last_key[sizeof(record_header2::key)];
+};
 
-            if (hd.is_body_present) {
-                mem_chunk buf = membuf.get_free_mem();
-                input.read_body(buf);
-                membuf.write(buf);
-            }
 
-            input.parse_next();
-        }
-        std::sort(vb, ve);
+/* memory of a merge pass: the output buffer, a block per input run and
+ * the prefetch pool (as many blocks as runs at least) */
+static const size_t MERGE_OUTPUT_BUF_SIZE = 40 * MiB;
+static const size_t MERGE_BLOCK_MIN_SIZE = 1 * MiB;
+static const size_t MERGE_BLOCK_MAX_SIZE = 8 * MiB;
 
-        bool is_final = (segment_no==0 && !input.is_header_valid());
-        file_id_t output_file_id;
 
-        if (is_final) {
-            output_file_id = dest_file;
-        } else {
-            output_file_id = file_id::create_temporary("yndx-xxlsort");
-            transient_files.push_back(output_file_id);
-        }
+/*
+ * Open files a merge pass may have besides the runs and the body files:
+ * stdio, the input, the output and some slack.
+ */
+static const size_t MERGE_RESERVED_FILES = 8;
 
-        render_buf output(output_mem, output_file_id);
-        for (sort_element *i = vb; i != ve; i++) {
-            if (is_final) {
-                /* export public format (record_header) */
-                export_record(i->get_header(), output, input2);
-            } else {
-                /* write private extended format (record_header2) */
-                output.put(i->get_header());
-            }
-            output.write(i->get_body());
-        }
-        output.flush();
-        segment_no ++;
-    }
-    while (input.is_header_valid());
+
+/* open files left for the runs and the body files of a merge pass */
+size_t get_merge_files_budget()
+{
+    size_t limit = get_open_files_limit();
+    return limit > MERGE_RESERVED_FILES ? limit - MERGE_RESERVED_FILES : 0;
 }
 
 
-class merge_element
+/* the larger part of the arena on either side of the used memory */
+mem_chunk get_mem_around(const mem_chunk &arena, const mem_chunk &used)
+{
+    mem_chunk before(arena.begin(), used.begin() - arena.begin());
+    mem_chunk after(used.end(), arena.end() - used.end());
+    return (before.size() > after.size() ? before : after).aligned();
+}
+
+
+/*
+ * Writes records to a run.  With separate bodies the bodies present go
+ * to a body file of the run instead, the run gets headers only (pointing
+ * into the body file).  Merge passes move these headers alone, bodies
+ * are gathered once by the final pass.  Body files are read at random
+ * then, hence they are never compressed.
+ */
+class run_output
 {
     public:
-        merge_element(parser<record_header2> &stream_)
+        run_output(
+            const sort_options &options,
+            const mem_chunk &mem,
+            run_file &run_,
+            const body_spool *spool)
+            : run(run_)
         {
-            stream = &stream_;
+            if (spool) {
+                run.body_files.push_back(spool->get_file_id());
+            }
+            mem_chunk header_mem = mem, body_mem;
+            if (options.separate_bodies) {
+                mem.split_at(mem.size() / 2, header_mem, body_mem);
+                run.body_files.push_back(file_id::create_temporary("yndx-xxlsort"));
+                bodies.reset(new render_buf(body_mem, run.body_files.back(), options.write_buffers));
+            }
+            output.reset(new render_buf(
+                header_mem, run.id, options.write_buffers, run.blocks.get()));
         }
-        bool operator < (const merge_element &other) const
+        void write(const record_header2 &hd, const mem_chunk &body)
         {
-            /* in fact this is >=, since the operator is used by
-             * std::make_/push_/pop_heap functions which put the largest
-             * element on the top of the heap while we want the smallest */
-            return memcmp(
-                stream->get_header().key,
-                other.stream->get_header().key, sizeof(record_header::key)) >= 0;
+            if (bodies && hd.is_body_present) {
+                record_header2 hd2 = hd;
+                hd2.body_pos = bodies->get_file_pos();
+                hd2.body_file = run.body_files.size();
+                hd2.is_body_present = 0;
+                bodies->write(body);
+                run.put_header(*output, hd2);
+                return;
+            }
+            run.put_header(*output, hd);
+            output->write(body);
         }
-        bool write_record_and_parse_next(render_buf &output)
+        void flush()
         {
-            output.put(stream->get_header());
-            copy_inline_body(output);
-            return stream->parse_next();
+            output->flush();
+            if (bodies) {
+                bodies->flush();
+            }
         }
-        bool export_record_and_parse_next(render_buf &output, input_file &input)
+    private:
+        run_file                    &run;
+        std::unique_ptr<render_buf>  output;
+        std::unique_ptr<render_buf>  bodies;
+};
+
+
+/*
+ * Writes sorted segments to transient files.  A segment continuing the
+ * order of the previous one is appended to the same run, hence on
+ * (nearly) presorted input runs span multiple memory loads.
+ */
+class run_writer
+{
+    public:
+        run_writer(
+            const sort_options &options_,
+            const mem_chunk &output_mem_,
+            std::deque<run_file> &transient_files_,
+            const body_spool *spool_,
+            const mem_chunk &merge_mem_ = mem_chunk())
+            : options(options_), output_mem(output_mem_), transient_files(transient_files_),
+              spool(spool_), merge_mem(merge_mem_)
         {
-            const record_header2 &hd2 = stream->get_header();
-            export_record(hd2, output, input);
-            copy_inline_body(output);
-            return stream->parse_next();
         }
-    private:
-        parser<record_header2>  *stream;
-    private:
-        void copy_inline_body(render_buf &output)
+        template <typename element_t>
+        void write(const element_t *vb, const element_t *ve)
         {
-            while (1) {
-                mem_chunk buf = output.get_free_mem();
-                if (!stream->read_body(buf)) {
-                    break;
-                }
-                output.write(buf);
+            if (vb == ve) {
+                return;
+            }
+            if (output && compare_keys(vb->get_header().key, last_key) < 0) {
+                close();
+            }
+            if (!output) {
+                transient_files.push_back(run_file(
+                    file_id::create_temporary("yndx-xxlsort"), options.compress_runs));
+                output.reset(new run_output(options, output_mem, transient_files.back(), spool));
+            }
+            for (const element_t *i = vb; i != ve; i++) {
+                output->write(i->get_header(), i->get_body());
+            }
+            memcpy(last_key, (ve - 1)->get_header().key, sizeof last_key);
+        }
+        /*
+         * The last segment may stay in memory and take part in the first
+         * merge pass as a resident run, it isn't written and read back
+         * then.  The sort elements (at the end of the segment memory,
+         * data_end is where the records end) are turned into plain
+         * record pointers moved down next to the records; the rest of
+         * merge_mem must be enough for merging the runs written in a
+         * single pass, otherwise the segment is written as usual.  Being
+         * the last segment written, it sees all the other runs.
+         */
+        template <typename element_t>
+        bool write_resident(
+            uint8_t *data_begin, uint8_t *data_end, const element_t *vb, const element_t *ve)
+        {
+            if (merge_mem.empty() || vb == ve) {
+                return false;
+            }
+            uintptr_t p = reinterpret_cast<uintptr_t>(data_end);
+            p = (p + alignof(record_header2 *) - 1) & ~uintptr_t(alignof(record_header2 *) - 1);
+            const record_header2 **records = reinterpret_cast<const record_header2 **>(p);
+            size_t n = ve - vb;
+            mem_chunk used(data_begin, reinterpret_cast<uint8_t *>(records + n) - data_begin);
+
+            close();
+            size_t num_runs = std::max<size_t>(1, transient_files.size());
+            if (get_mem_around(merge_mem, used).size()
+                < MERGE_OUTPUT_BUF_SIZE + num_runs * 2 * MERGE_BLOCK_MIN_SIZE) {
+                return false;
+            }
+
+            /* a pointer is half the element size, the one written never
+             * overlaps elements not read yet */
+            static_assert(sizeof(element_t) >= sizeof(record_header2 *), "element_t size");
+            for (size_t i = 0; i != n; i++) {
+                records[i] = &vb[i].get_header();
+            }
+
+            transient_files.push_back(run_file(file_id_t(), false));
+            run_file &run = transient_files.back();
+            run.records = records;
+            run.records_end = records + n;
+            run.mem = used;
+            if (spool) {
+                run.body_files.push_back(spool->get_file_id());
+            }
+            run.size = used.size();
+            for (size_t i = 0; i != n; i++) {
+                run.export_size += repr_traits<record_header>::SIZE + records[i]->body_size;
+            }
+            return true;
+        }
+        void close()
+        {
+            if (output) {
+                output->flush();
+                output.reset();
             }
         }
+    private:
+        const sort_options          &options;
+        mem_chunk                    output_mem;
+        std::deque<run_file>        &transient_files;
+        const body_spool            *spool;
+        mem_chunk                    merge_mem;
+        std::unique_ptr<run_output>  output;
+        uint8_t                      last_key[sizeof(record_header::key)];
 };
 
 
-void merge_sorted(
-    const mem_chunk &available_mem_,
-    const file_id_t &src_file,
-    const file_id_t &dest_file,
-    std::deque<file_id_t> &transient_files)
+/*
+ * A portion of input loaded in memory and sorted there.
+ *
+ * Memory layout:
+ *
+ * DATA DATA DATA .... DATA -> FREE FREE FREE .... FREE <- P P P .... P
+ */
+template <typename element_t>
+class segment
 {
-    std::vector<std::unique_ptr<parser<record_header2>>> input_streams;
-    std::vector<merge_element> merger;
-
-    input_file input(src_file);
+    public:
+        segment(const mem_chunk &mem_)
+            : mem(mem_), membuf(mem_), is_ascending(true), is_descending(true),
+              common_prefix(sizeof(record_header::key)), is_final(false), is_last(false),
+              node(0), seq(0)
+        {
+            vb = ve = reinterpret_cast<element_t *>(membuf.get_free_mem().end());
+        }
+        /* Load as many records as fit (at least one, unless EOF) */
+        void load(
+            parser<record_header2, record_header> &input,
+            file_size_t threshold,
+            body_spool *spool)
+        {
+            while (input.is_header_valid()) {
+                size_t available_sz = membuf.get_free_mem().size();
+                size_t reserved_sz = (ve - vb + 1)*(sizeof *vb);
+                size_t body_sz;
+                record_header2 hd = input.get_header();
+
+                if (hd.body_size >= threshold) {
+                    hd.is_body_present = 0;
+                    body_sz = 0;
+                } else {
+                    body_sz = hd.body_size;
+                }
 
-    while (!transient_files.empty())
-    {
-        mem_chunk available_mem = available_mem_;
-        mem_chunk output_buf_mem;
-        available_mem.split_at(40 * MiB, output_buf_mem, available_mem);
+                if (available_sz < alignof(hd) + sizeof(hd) + body_sz + reserved_sz) {
+                    break;
+                }
+                if (spool && !hd.is_body_present) {
+                    spool->store(input, hd);
+                }
 
-        input_streams.clear();
-        merger.clear();
+                membuf.align(alignof(hd));
+                record_header2 *p = membuf.put(hd);
+                if (vb != ve) {
+                    /* detecting presorted input */
+                    int s = compare_keys(vb->get_header().key, p->key);
+                    is_ascending &= (s <= 0);
+                    is_descending &= (s >= 0);
+                    /* the longest common prefix of all keys */
+                    const uint8_t *first_key = (ve - 1)->get_header().key;
+                    size_t i = 0;
+                    while (i < common_prefix && first_key[i] == p->key[i]) {
+                        i++;
+                    }
+                    common_prefix = i;
+                }
+                element_t::init(*(--vb), p);
 
-        const size_t input_buf_size = 25 * MiB;
-        while (available_mem.size() >= input_buf_size && !transient_files.empty()) {
+                if (hd.is_body_present) {
+                    mem_chunk buf = membuf.get_free_mem();
+                    input.read_body(buf);
+                    membuf.write(buf);
+                }
 
-            mem_chunk input_buf_mem;
-            available_mem.split_at(input_buf_size, input_buf_mem, available_mem);
+                input.parse_next();
+            }
+            if (vb == ve && input.is_header_valid()) {
+                throw std::runtime_error("Not enough memory for split phase");
+            }
+        }
+        void sort(const sort_options &options)
+        {
+            /* the stack holds elements in the reverse order of arrival */
+            if (is_ascending) {
+                std::reverse(vb, ve);
+            } else if (!is_descending) {
+                size_t prefix_offset = std::min<size_t>(
+                    common_prefix, element_t::PREFIX_OFFSET_MAX);
+                if (prefix_offset != 0) {
+                    for (element_t *i = vb; i != ve; i++) {
+                        i->set_prefix_offset(prefix_offset);
+                    }
+                }
+                sort_elements(options, vb, ve);
+            }
+        }
+        void write(
+            const sort_options &options,
+            const mem_chunk &output_mem,
+            const file_id_t &dest_file,
+            run_writer &runs,
+            body_source &bodies)
+        {
+            if (is_final) {
+                export_sorted(options, vb, ve, output_mem, dest_file, bodies);
+            } else if (!is_last
+                || !runs.write_resident(mem.begin(), mem.begin() + membuf.get_file_pos(), vb, ve)) {
+                runs.write(vb, ve);
+            }
+        }
+        const mem_chunk &get_mem() const { return mem; }
+    private:
+        mem_chunk      mem;
+        render_buf     membuf;
+        element_t     *vb, *ve;
+        bool           is_ascending, is_descending;
+        size_t         common_prefix;
+    public:
+        /* the only segment */
+        bool           is_final;
+        /* the last one, see run_writer::write_resident */
+        bool           is_last;
+        size_t         node;
+        /* the number in the load order, segments are written in order */
+        size_t         seq;
+};
 
-            std::unique_ptr<parser<record_header2>> p(
-                new parser<record_header2>(input_buf_mem, transient_files.front()));
-            transient_files.pop_front();
 
-            if (p->is_header_valid()) {
-                merger.push_back(*p);
-                input_streams.push_back(std::move(p));
+/*
+ * Replacement selection run formation.
+ *
+ * Records are appended to a log at the beginning of the memory, their
+ * sort_element entries grow down from the end.  The entries form a
+ * min-heap of the records belonging to the current run followed by a
+ * pile of the records that came too late for it (keys less than the
+ * last key written) and are going to start the next run.  When a new
+ * record doesn't fit, the smallest one is evicted to the run.  On
+ * random input runs are about twice the memory size, presorted input
+ * yields a single run.
+ *
+ * Memory layout:
+ *
+ * BITMAP LOG LOG .. LOG -> FREE FREE .... FREE <- PILE PILE <- HEAP HEAP
+ *
+ * The space of evicted records is reclaimed by compacting the log;
+ * live 64-byte units are tracked with the bitmap, the new offset of a
+ * record is the number of live units preceding it.  Entries are updated
+ * in place, the heap order is not affected.
+ */
+template <typename element_t>
+class replacement_selection
+{
+    public:
+        replacement_selection(
+            const sort_options &options_,
+            const mem_chunk &mem,
+            const mem_chunk &output_mem_,
+            std::deque<run_file> &transient_files_,
+            body_spool *spool_)
+            : options(options_), output_mem(output_mem_),
+              transient_files(transient_files_), spool(spool_),
+              heap_size(0), n(0), log_units(0), dead_units(0), has_runs(false)
+        {
+            size_t max_units = mem.size() / 64;
+            size_t num_words = (max_units + 63) / 64;
+            bitmap = reinterpret_cast<uint64_t *>(mem.begin());
+            ranks = reinterpret_cast<uint64_t *>(bitmap + num_words);
+            mem_chunk log_mem = mem.sub_chunk(num_words * (sizeof *bitmap + sizeof *ranks), -1).aligned();
+            log_begin = log_end = log_mem.begin();
+            top = reinterpret_cast<element_t *>(log_mem.end());
+            entries = std::reverse_iterator<element_t *>(top);
+            memset(bitmap, 0, num_words * sizeof *bitmap);
+        }
+        void run(
+            parser<record_header2, record_header> &input,
+            file_size_t threshold,
+            const file_id_t &dest_file,
+            body_source &bodies)
+        {
+            while (input.is_header_valid()) {
+                record_header2 hd = input.get_header();
+                size_t body_sz;
+
+                if (hd.body_size >= threshold) {
+                    hd.is_body_present = 0;
+                    body_sz = 0;
+                } else {
+                    body_sz = hd.body_size;
+                }
+
+                size_t units = get_units(body_sz);
+                while (!fits(units)) {
+                    if (dead_units != 0 && (dead_units >= log_units / 8 || n == 0)) {
+                        compact();
+                    } else if (n != 0) {
+                        evict();
+                    } else {
+                        throw std::runtime_error("Not enough memory for split phase");
+                    }
+                }
+
+                if (spool && !hd.is_body_present) {
+                    spool->store(input, hd);
+                }
+                record_header2 *p = reinterpret_cast<record_header2 *>(log_end);
+                memcpy(p, &hd, repr_traits<record_header2>::SIZE);
+                if (hd.is_body_present) {
+                    mem_chunk buf(p->body, body_sz);
+                    input.read_body(buf);
+                }
+                set_bits(log_units, log_units + units, true);
+                log_units += units;
+                log_end += units * 64;
+
+                element_t e;
+                element_t::init(e, p);
+                insert(e);
+
+                input.parse_next();
+            }
+
+            if (!has_runs) {
+                /* everything fit in memory */
+                sort_elements(options, top - n, top);
+                export_sorted(options, top - n, top, output_mem, dest_file, bodies);
+                return;
+            }
+
+            while (heap_size != 0) {
+                evict();
+            }
+            end_run();
+
+            if (n != 0) {
+                sort_elements(options, top - n, top);
+                run_writer runs(options, output_mem, transient_files, spool);
+                runs.write(top - n, top);
+                runs.close();
             }
         }
 
-        if (input_streams.size()<2) {
-            throw std::runtime_error("Not enough memory for merge phase");
+    private:
+        const sort_options          &options;
+        mem_chunk                    output_mem;
+        std::deque<run_file>        &transient_files;
+        body_spool                  *spool;
+        std::unique_ptr<run_output>  output;
+
+        uint64_t      *bitmap;
+        uint64_t      *ranks;
+        uint8_t       *log_begin, *log_end;
+        element_t     *top;
+        /* entries[0 .. heap_size) - heap, entries[heap_size .. n) - pile */
+        std::reverse_iterator<element_t *>  entries;
+        size_t         heap_size, n;
+        size_t         log_units, dead_units;
+        bool           has_runs;
+        uint8_t        last_key[sizeof(record_header::key)];
+
+        static bool greater(const element_t &a, const element_t &b)
+        {
+            return b < a;
         }
 
-        bool is_final = transient_files.empty();
-        file_id_t output_file_id;
+        static size_t get_units(size_t body_sz)
+        {
+            return (repr_traits<record_header2>::SIZE + body_sz + 63) / 64;
+        }
 
-        if (is_final) {
-            output_file_id = dest_file;
-        } else {
-            output_file_id = file_id::create_temporary("yndx-xxlsort");
-            transient_files.push_back(output_file_id);
+        size_t get_unit(const element_t &e) const
+        {
+            return (reinterpret_cast<const uint8_t *>(&e.get_header()) - log_begin) / 64;
+        }
+
+        bool fits(size_t units) const
+        {
+            return log_end + units * 64 + sizeof(element_t)
+                <= reinterpret_cast<uint8_t *>(top - n);
+        }
+
+        void insert(const element_t &e)
+        {
+            if (has_runs && compare_keys(e.get_header().key, last_key) < 0) {
+                entries[n++] = e;
+                return;
+            }
+            if (n != heap_size) {
+                entries[n] = entries[heap_size];
+            }
+            entries[heap_size++] = e;
+            n++;
+            std::push_heap(entries, entries + heap_size, greater);
         }
 
-        render_buf output(output_buf_mem, output_file_id);
+        /* write the smallest record to the current run, start the next
+         * run if the current one is over */
+        void evict()
+        {
+            if (heap_size == 0) {
+                end_run();
+                heap_size = n;
+                std::make_heap(entries, entries + heap_size, greater);
+            }
 
-        std::make_heap(merger.begin(), merger.end());
-        while (!merger.empty()) {
+            std::pop_heap(entries, entries + heap_size, greater);
+            element_t e = entries[--heap_size];
+            entries[heap_size] = entries[--n];
 
-            std::pop_heap(merger.begin(), merger.end());
+            if (!output) {
+                transient_files.push_back(run_file(
+                    file_id::create_temporary("yndx-xxlsort"), options.compress_runs));
+                output.reset(new run_output(options, output_mem, transient_files.back(), spool));
+                has_runs = true;
+            }
 
-            bool has_more;
-            if (is_final) {
-                /* export public format (record_header) */
-                has_more = merger.back().export_record_and_parse_next(output, input);
+            const record_header2 &hd = e.get_header();
+            output->write(hd, e.get_body());
+            memcpy(last_key, hd.key, sizeof last_key);
+
+            size_t unit = get_unit(e);
+            size_t units = get_units(e.get_body().size());
+            set_bits(unit, unit + units, false);
+            dead_units += units;
+        }
+
+        void end_run()
+        {
+            if (output) {
+                output->flush();
+                output.reset();
+            }
+        }
+
+        void compact()
+        {
+            size_t num_words = (log_units + 63) / 64;
+            uint64_t rank = 0;
+            for (size_t i = 0; i < num_words; i++) {
+                ranks[i] = rank;
+                rank += __builtin_popcountll(bitmap[i]);
+            }
+
+            for (size_t i = 0; i < n; i++) {
+                size_t unit = get_unit(entries[i]);
+                uint64_t mask = (uint64_t(1) << (unit % 64)) - 1;
+                size_t new_unit = ranks[unit / 64] + __builtin_popcountll(bitmap[unit / 64] & mask);
+                entries[i].relocate(reinterpret_cast<record_header2 *>(log_begin + new_unit * 64));
+            }
+
+            size_t live_units = 0;
+            size_t unit = find_bit(0, true);
+            while (unit != log_units) {
+                size_t end = find_bit(unit, false);
+                memmove(
+                    log_begin + live_units * 64,
+                    log_begin + unit * 64,
+                    (end - unit) * 64);
+                live_units += end - unit;
+                unit = find_bit(end, true);
+            }
+
+            set_bits(0, live_units, true);
+            set_bits(live_units, log_units, false);
+            log_units = live_units;
+            log_end = log_begin + live_units * 64;
+            dead_units = 0;
+        }
+
+        /* index of the first bit >= from having the value (log_units if none) */
+        size_t find_bit(size_t from, bool value) const
+        {
+            while (from < log_units) {
+                uint64_t w = value ? bitmap[from / 64] : ~bitmap[from / 64];
+                w &= ~uint64_t(0) << (from % 64);
+                if (w != 0) {
+                    return std::min(log_units, from / 64 * 64 + __builtin_ctzll(w));
+                }
+                from = (from / 64 + 1) * 64;
+            }
+            return log_units;
+        }
+
+        void set_bits(size_t from, size_t to, bool value)
+        {
+            while (from < to) {
+                size_t count = std::min<size_t>(to - from, 64 - from % 64);
+                uint64_t mask = (count == 64 ? ~uint64_t(0) : (uint64_t(1) << count) - 1) << (from % 64);
+                if (value) {
+                    bitmap[from / 64] |= mask;
+                } else {
+                    bitmap[from / 64] &= ~mask;
+                }
+                from += count;
+            }
+        }
+};
+
+
+template <typename element_t>
+void form_runs(
+    const sort_options &options,
+    parser<record_header2, record_header> &input,
+    file_size_t threshold,
+    body_spool *spool,
+    body_source &bodies,
+    const mem_chunk &output_mem,
+    const mem_chunk &segments_mem,
+    const mem_chunk &merge_mem,
+    const file_id_t &dest_file,
+    std::deque<run_file> &transient_files)
+{
+    if (options.run_formation == RUN_FORMATION_REPLACEMENT_SELECTION) {
+        replacement_selection<element_t> rs(
+            options, segments_mem, output_mem, transient_files, spool);
+        rs.run(input, threshold, dest_file, bodies);
+        return;
+    }
+
+    run_writer runs(options, output_mem, transient_files, spool, merge_mem);
+
+    std::vector<numa_node> numa_nodes;
+    if (options.numa) {
+        numa_nodes = get_numa_nodes();
+        if (numa_nodes.size() < 2) {
+            numa_nodes.clear();
+        }
+    }
+
+    if (options.split_pipeline_depth < 2 && numa_nodes.empty()) {
+        int segment_no = 0;
+        do {
+            segment<element_t> seg(segments_mem);
+            seg.load(input, threshold, spool);
+            seg.sort(options);
+            seg.is_final = (segment_no==0 && !input.is_header_valid());
+            seg.is_last = !input.is_header_valid();
+            seg.write(options, output_mem, dest_file, runs, bodies);
+            segment_no ++;
+        }
+        while (input.is_header_valid());
+        runs.close();
+        return;
+    }
+
+    /*
+     * Pipelined mode: memory is divided into several segment regions,
+     * loading, sorting and writing happen concurrently in different
+     * regions.  Segments are smaller but the run generation is bound
+     * by the slowest stage rather than by the sum of all three.
+     *
+     * NUMA mode: regions are spread over the nodes (segments go to the
+     * nodes in turn), every node has a sorting stage of its own running
+     * on the node's CPUs.  Records are loaded by a thread moving to the
+     * node the region belongs to.
+     */
+    typedef std::unique_ptr<segment<element_t>> segment_ptr;
+
+    size_t num_nodes = std::max<size_t>(1, numa_nodes.size());
+    size_t num_regions = num_nodes * options.split_pipeline_depth;
+    std::vector<blocking_queue<mem_chunk>> free_regions(num_nodes);
+    std::vector<blocking_queue<segment_ptr>> loaded(num_nodes);
+    blocking_queue<segment_ptr> sorted;
+    std::atomic<size_t> sorters_running(num_nodes);
+
+    sort_options node_options = options;
+    node_options.num_threads = std::max<size_t>(1, options.num_threads / num_nodes);
+
+    size_t region_size = segments_mem.size() / num_regions;
+    for (size_t i = 0; i < num_regions; i++) {
+        mem_chunk region = segments_mem.sub_chunk(i * region_size, region_size).aligned();
+        if (!numa_nodes.empty() && !options.hugetlb_arena) {
+            bind_to_numa_node(region, numa_nodes[i % num_nodes]);
+        }
+        free_regions[i % num_nodes].push(region);
+    }
+
+    auto close_all = [&]() {
+        for (auto &q: free_regions) {
+            q.close();
+        }
+        for (auto &q: loaded) {
+            q.close();
+        }
+        sorted.close();
+    };
+
+    /*
+     * Stage 0 (the writer) runs in the calling thread, the loader and
+     * the sorters get threads of their own: pinning them to nodes
+     * doesn't affect the caller and the threads it creates later.
+     */
+    run_parallel(num_nodes + 2, [&](unsigned stage) {
+        try {
+            mem_chunk region;
+            segment_ptr seg;
+            if (stage == 1) {
+                for (size_t segment_no = 0; ; segment_no++) {
+                    size_t node = segment_no % num_nodes;
+                    if (!free_regions[node].pop(region)) {
+                        break;
+                    }
+                    if (!numa_nodes.empty()) {
+                        pin_thread_to_numa_node(numa_nodes[node]);
+                    }
+                    seg.reset(new segment<element_t>(region));
+                    seg->load(input, threshold, spool);
+                    seg->is_final = (segment_no==0 && !input.is_header_valid());
+                    seg->is_last = !input.is_header_valid();
+                    seg->node = node;
+                    seg->seq = segment_no;
+                    loaded[node].push(std::move(seg));
+                    if (!input.is_header_valid()) {
+                        break;
+                    }
+                }
+                for (auto &q: loaded) {
+                    q.close();
+                }
+            } else if (stage == 0) {
+                /*
+                 * Nodes sort concurrently, segments come out of order;
+                 * they are written in the load order nevertheless (the
+                 * last one is expected to be the last, runs continuing
+                 * from segment to segment follow the input).  Segments
+                 * pending are sorted already, those missing are being
+                 * sorted, hence no deadlock.
+                 */
+                std::map<size_t, segment_ptr> pending;
+                size_t next_seq = 0;
+                while (sorted.pop(seg)) {
+                    size_t seq = seg->seq;
+                    pending[seq] = std::move(seg);
+                    for (auto i = pending.begin(); i != pending.end() && i->first == next_seq; ) {
+                        i->second->write(options, output_mem, dest_file, runs, bodies);
+                        free_regions[i->second->node].push(i->second->get_mem());
+                        i = pending.erase(i);
+                        next_seq++;
+                    }
+                }
+                runs.close();
+                for (auto &q: free_regions) {
+                    q.close();
+                }
             } else {
-                /* write private extended format (record_header2) */
-                has_more = merger.back().write_record_and_parse_next(output);
+                size_t node = stage - 2;
+                if (!numa_nodes.empty()) {
+                    pin_thread_to_numa_node(numa_nodes[node]);
+                }
+                while (loaded[node].pop(seg)) {
+                    seg->sort(node_options);
+                    sorted.push(std::move(seg));
+                }
+                if (--sorters_running == 0) {
+                    sorted.close();
+                }
             }
+        }
+        catch (...) {
+            /* unblock the other stages */
+            close_all();
+            throw;
+        }
+    });
+}
+
+
+void split_and_sort(
+    const sort_options &options,
+    const mem_chunk &available_mem_,
+    const file_id_t &src_file,
+    const file_id_t &dest_file,
+    std::deque<run_file> &transient_files)
+{
+    mem_chunk input_mem;
+    mem_chunk available_mem;
+    available_mem_.split_at(4 * MiB, input_mem, available_mem);
 
+    parser<record_header2, record_header> input(input_mem, src_file);
+    input_file input2(src_file);
+    /* bodies this large are left in the input (if seekable) or spooled */
+    file_size_t threshold = 1 * MiB;
+    std::unique_ptr<body_spool> spool;
+    std::vector<file_id_t> body_files;
+    if (input2.is_seekable()) {
+        if (options.key_pointers) {
+            threshold = 0;
+        }
+    } else {
+        mem_chunk spool_mem;
+        available_mem.split_at(1 * MiB, spool_mem, available_mem);
+        spool.reset(new body_spool(spool_mem));
+        body_files.push_back(spool->get_file_id());
+    }
+    body_source bodies(input2, body_files);
+
+    mem_chunk output_mem;
+    mem_chunk segments_mem;
+    available_mem.split_at(25 * MiB, output_mem, segments_mem);
+
+    /* offsets must be able to address the whole arena */
+    uint64_t arena_size =
+        reinterpret_cast<uintptr_t>(segments_mem.end())
+        - reinterpret_cast<uintptr_t>(sort_element_base::base);
+
+    if (arena_size <= sort_element::get_max_arena_size()) {
+        form_runs<sort_element>(
+            options, input, threshold, spool.get(), bodies, output_mem, segments_mem,
+            available_mem_, dest_file, transient_files);
+    } else if (arena_size <= wide_sort_element::get_max_arena_size()) {
+        form_runs<wide_sort_element>(
+            options, input, threshold, spool.get(), bodies, output_mem, segments_mem,
+            available_mem_, dest_file, transient_files);
+    } else {
+        throw std::runtime_error("Memory arena is too large");
+    }
+}
+
+
+class merge_element
+{
+    public:
+        /*
+         * Records with keys >= end_key (if any) are left alone.  Body
+         * file numbers of the run are mapped to those in bodies (and in
+         * the output run) with body_file_map, see body_source::add.
+         */
+        merge_element(
+            run_parser &stream_,
+            body_source &bodies_,
+            const uint32_t *body_file_map_ = nullptr,
+            const uint8_t *end_key_ = nullptr)
+        {
+            stream = &stream_;
+            next_record = records_end = nullptr;
+            bodies = &bodies_;
+            body_file_map = body_file_map_;
+            end_key = end_key_;
+            is_body_requested = false;
+            load_prefix();
+        }
+        /* a resident run (see run_file::records) */
+        merge_element(const run_file &run, body_source &bodies_, const uint32_t *body_file_map_)
+        {
+            stream = nullptr;
+            next_record = run.records;
+            records_end = run.records_end;
+            bodies = &bodies_;
+            body_file_map = body_file_map_;
+            end_key = nullptr;
+            is_body_requested = false;
+            load_prefix();
+        }
+        bool operator < (const merge_element &other) const
+        {
+            /* prefixes are right here, the keys are in the parsers */
+            if (prefix[0] != other.prefix[0]) {
+                return prefix[0] < other.prefix[0];
+            }
+            if (prefix[1] != other.prefix[1]) {
+                return prefix[1] < other.prefix[1];
+            }
+            return compare_keys(get_header().key, other.get_header().key) < 0;
+        }
+        bool is_valid() const
+        {
+            return is_header_valid()
+                && (!end_key || compare_keys(get_header().key, end_key) < 0);
+        }
+        bool write_record_and_parse_next(render_buf &output, run_file &run)
+        {
+            record_header2 tmp;
+            run.put_header(output, get_rebased_header(tmp));
+            copy_inline_body(output);
+            return parse_next();
+        }
+        bool export_record_and_parse_next(render_buf &output, body_look_ahead &look_ahead)
+        {
+            record_header2 tmp;
+            const record_header2 &hd2 = get_rebased_header(tmp);
+            export_record(hd2, output, *bodies);
+            copy_inline_body(output);
+            if (is_body_requested) {
+                look_ahead.release(hd2);
+                is_body_requested = false;
+            }
+            bool has_more = parse_next();
             if (has_more) {
-                std::push_heap(merger.begin(), merger.end());
+                request_body(look_ahead);
+            }
+            return has_more;
+        }
+        /* the record is on the merge frontier, it's exported soon;
+         * returns false if the window is full (try again later) */
+        bool request_body(body_look_ahead &look_ahead)
+        {
+            if (!is_body_requested && is_header_valid()) {
+                record_header2 tmp;
+                is_body_requested = look_ahead.request(get_rebased_header(tmp), *bodies);
+            }
+            return is_body_requested || !is_header_valid();
+        }
+    private:
+        /* the first 16 bytes of the current key, big endian (hence
+         * integers compare the way the bytes do) */
+        uint64_t                 prefix[2];
+        run_parser              *stream;
+        /* unless stream */
+        const record_header2 * const *next_record, * const *records_end;
+        body_source             *bodies;
+        const uint32_t          *body_file_map;
+        const uint8_t           *end_key;
+        bool                     is_body_requested;
+    private:
+        bool is_header_valid() const
+        {
+            return stream ? stream->is_header_valid() : next_record != records_end;
+        }
+        const record_header2 &get_header() const
+        {
+            return stream ? stream->get_header() : **next_record;
+        }
+        /* the header with body_file in terms of bodies (tmp is used
+         * if it needs a change) */
+        const record_header2 &get_rebased_header(record_header2 &tmp) const
+        {
+            const record_header2 &hd = get_header();
+            if (hd.body_file == 0 || !body_file_map
+                || body_file_map[hd.body_file - 1] == hd.body_file) {
+                return hd;
+            }
+            tmp = hd;
+            tmp.body_file = body_file_map[hd.body_file - 1];
+            return tmp;
+        }
+        void load_prefix()
+        {
+            if (is_header_valid()) {
+                memcpy(prefix, get_header().key, sizeof prefix);
+                prefix[0] = __builtin_bswap64(prefix[0]);
+                prefix[1] = __builtin_bswap64(prefix[1]);
+            }
+        }
+        bool parse_next()
+        {
+            if (stream) {
+                stream->parse_next();
             } else {
-                merger.pop_back();
+                next_record++;
             }
+            load_prefix();
+            return is_valid();
         }
-        output.flush();
+        void copy_inline_body(render_buf &output)
+        {
+            if (!stream) {
+                const record_header2 &hd = get_header();
+                if (hd.is_body_present) {
+                    output.write(mem_chunk(const_cast<uint8_t *>(hd.body), hd.body_size));
+                }
+                return;
+            }
+            while (1) {
+                mem_chunk buf = output.get_free_mem();
+                if (!stream->read_body(buf)) {
+                    break;
+                }
+                output.write(buf);
+            }
+        }
+};
+
+
+/*
+ * Output run is NULL in the final pass: records are exported in the
+ * public format (record_header) then, otherwise they are written in
+ * the private extended format (record_header2).
+ */
+bool write_record(
+    merge_element &e,
+    render_buf &output,
+    body_look_ahead &look_ahead,
+    run_file *output_run)
+{
+    if (!output_run) {
+        return e.export_record_and_parse_next(output, look_ahead);
+    } else {
+        return e.write_record_and_parse_next(output, *output_run);
+    }
+}
+
+
+void merge_streams(
+    const sort_options &options,
+    std::vector<merge_element> &merger,
+    render_buf &output,
+    run_file *output_run)
+{
+    body_look_ahead look_ahead(options.look_ahead);
+    /* frontier records the window had no room for, requested again as
+     * exports make room */
+    std::deque<merge_element *> refused;
+    if (!output_run) {
+        for (auto &e: merger) {
+            if (!e.request_body(look_ahead)) {
+                refused.push_back(&e);
+            }
+        }
+    }
+    auto write = [&](merge_element &e) {
+        bool has_more = write_record(e, output, look_ahead, output_run);
+        if (!output_run) {
+            while (!refused.empty() && refused.front()->request_body(look_ahead)) {
+                refused.pop_front();
+            }
+            if (!e.request_body(look_ahead)
+                && std::find(refused.begin(), refused.end(), &e) == refused.end()) {
+                refused.push_back(&e);
+            }
+        }
+        return has_more;
+    };
+
+    loser_tree<merge_element> tree(merger);
+    while (!tree.empty()) {
+
+        merge_element &winner = merger[tree.top()];
+        bool has_more = write(winner);
+
+        if (has_more) {
+            tree.replay(false);
+            if (&merger[tree.top()] != &winner) {
+                continue;
+            }
+            /*
+             * The stream won again: keep taking records from it while
+             * it is still ahead of the others (presorted input yields
+             * runs that hardly overlap, it's one comparison per record
+             * then)
+             */
+            const merge_element *runner_up = tree.runner_up();
+            do {
+                has_more = write(winner);
+            }
+            while (has_more && (!runner_up || !(*runner_up < winner)));
+        }
+        tree.replay(!has_more);
+    }
+    output.flush();
+}
+
+
+/*
+ * The final merge pass split into key ranges merged concurrently.
+ *
+ * Splitters are picked from the sparse indices of the runs so that the
+ * ranges are roughly equal in the output size.  Every thread finds
+ * where its range starts in each run (an index lookup followed by a
+ * short scan); sizes of the records skipped add up to the offset of the
+ * range in the output.  Returns false if the memory doesn't permit
+ * running several threads or the destination is not seekable.
+ */
+bool merge_partitioned(
+    const sort_options &options,
+    const mem_chunk &available_mem,
+    const file_id_t &src_file,
+    const file_id_t &dest_file,
+    std::deque<run_file> &transient_files,
+    thread_pool *read_ahead)
+{
+    /* an output buffer (4 units) and an input buffer per run; files
+     * of a range are the runs, the input, the output and a body file
+     * at least */
+    const size_t min_buf_size = 1 * MiB;
+    size_t num_runs = transient_files.size();
+    size_t files_budget = get_merge_files_budget();
+    size_t num_partitions = std::min<size_t>(
+        options.merge_threads, available_mem.size() / ((num_runs + 4) * min_buf_size));
+    num_partitions = std::min(num_partitions, files_budget / (num_runs + 3));
+    if (num_partitions < 2) {
+        return false;
+    }
+    /* ranges are written at their offsets by files opened without
+     * O_TRUNC, the destination is sized here once and for all */
+    output_file dest(dest_file);
+    if (!dest.is_seekable()) {
+        return false;
+    }
+
+    struct sample
+    {
+        const uint8_t  *key;
+        file_size_t     size;
+    };
+    std::vector<sample> samples;
+    file_size_t total_size = 0;
+    for (const run_file &run: transient_files) {
+        for (size_t i = 0; i < run.index.size(); i++) {
+            file_pos_t next = i + 1 < run.index.size() ? run.index[i + 1].export_pos : run.export_size;
+            samples.push_back(sample{run.index[i].key, next - run.index[i].export_pos});
+        }
+        total_size += run.export_size;
+    }
+    std::sort(samples.begin(), samples.end(), [](const sample &a, const sample &b) {
+        return compare_keys(a.key, b.key) < 0;
+    });
+
+    /* range i covers keys in [splitters[i], splitters[i+1]), NULL
+     * stands for -inf (first) and +inf (last) */
+    std::vector<const uint8_t *> splitters(1, nullptr);
+    file_size_t size_before = 0;
+    for (const sample &s: samples) {
+        if (splitters.size() < num_partitions
+            && size_before >= total_size / num_partitions * splitters.size()) {
+            splitters.push_back(s.key);
+        }
+        size_before += s.size;
+    }
+    num_partitions = splitters.size();
+    splitters.push_back(nullptr);
+
+    /* no stale bytes past the end if the file existed and was longer */
+    dest.truncate(total_size);
+
+    size_t share = available_mem.size() / num_partitions;
+    size_t output_buf_size = std::min(40 * MiB, share / 4);
+    size_t input_buf_size = (share - output_buf_size) / num_runs;
+
+    run_parallel(num_partitions, [&](unsigned i) {
+        mem_chunk mem = available_mem.sub_chunk(i * share, share);
+        mem_chunk output_buf_mem;
+        mem.split_at(output_buf_size, output_buf_mem, mem);
+
+        const uint8_t *begin_key = splitters[i], *end_key = splitters[i + 1];
+        input_file input(src_file);
+        body_source bodies(
+            input, std::vector<file_id_t>(), files_budget / num_partitions - num_runs - 2);
+        std::vector<std::unique_ptr<run_parser>> input_streams;
+        std::vector<merge_element> merger;
+        file_pos_t offset = 0;
+
+        for (const run_file &run: transient_files) {
+            mem_chunk input_buf_mem;
+            mem.split_at(input_buf_size, input_buf_mem, mem);
+            if (run.index.empty()) {
+                continue;
+            }
+
+            /* the last indexed record preceding the range */
+            auto start = run.index.begin();
+            if (begin_key) {
+                auto it = std::lower_bound(
+                    run.index.begin(), run.index.end(), begin_key,
+                    [](const run_index_entry &e, const uint8_t *key) {
+                        return compare_keys(e.key, key) < 0;
+                    });
+                if (it != run.index.begin()) {
+                    start = it - 1;
+                }
+            }
+
+            std::unique_ptr<run_parser> p(
+                new run_parser(
+                    input_buf_mem, run.id, start->pos, read_ahead, run.blocks));
+            offset += start->export_pos;
+            while (begin_key && p->is_header_valid()
+                && compare_keys(p->get_header().key, begin_key) < 0) {
+                offset += repr_traits<record_header>::SIZE + p->get_header().body_size;
+                p->parse_next();
+            }
+
+            merge_element e(*p, bodies, bodies.add(run.body_files), end_key);
+            if (e.is_valid()) {
+                merger.push_back(e);
+                input_streams.push_back(std::move(p));
+            }
+        }
+
+        render_buf output(output_buf_mem, dest_file, offset, options.write_buffers);
+        merge_streams(options, merger, output, nullptr);
+    });
+
+    transient_files.clear();
+    return true;
+}
+
+
+/*
+ * The forecast of a run read by merge_sorted: the key of the last
+ * indexed record preceding pos.  That's a lower bound of the keys
+ * loaded from pos on, as good a guess as the sparse index permits.
+ */
+prefetch_pool::forecast_fn get_forecast(const run_file &run)
+{
+    std::vector<run_index_entry> index = run.index;
+    file_size_t size = run.size;
+    return [index, size](file_pos_t pos) -> const uint8_t * {
+        if (pos >= size) {
+            return nullptr;
+        }
+        auto it = std::lower_bound(
+            index.begin(), index.end(), pos,
+            [](const run_index_entry &e, file_pos_t pos) { return e.pos < pos; });
+        return it == index.begin() ? it->key : (it - 1)->key;
+    };
+}
+
+
+void merge_sorted(
+    const sort_options &options,
+    const mem_chunk &available_mem_,
+    const file_id_t &src_file,
+    const file_id_t &dest_file,
+    std::deque<run_file> &transient_files)
+{
+    std::unique_ptr<thread_pool> read_ahead;
+    if (options.read_ahead_threads != 0) {
+        read_ahead.reset(new thread_pool(options.read_ahead_threads));
+    }
+
+    /* outlives the streams */
+    std::unique_ptr<prefetch_pool> prefetch;
+    std::vector<std::unique_ptr<run_parser>> input_streams;
+    std::unique_ptr<body_source> bodies;
+    std::vector<merge_element> merger;
+
+    input_file input(src_file);
+    /* a file per run, as many body files open at least */
+    size_t files_budget = get_merge_files_budget();
+
+    /* the resident run (if any) is merged in the first pass */
+    auto resident = std::find_if(
+        transient_files.begin(), transient_files.end(),
+        [](const run_file &run) { return run.records != nullptr; });
+    if (resident != transient_files.end()) {
+        run_file run = std::move(*resident);
+        transient_files.erase(resident);
+        transient_files.push_front(std::move(run));
+    }
+
+    while (!transient_files.empty())
+    {
+        /* buffers of a pass with the resident run are around it */
+        bool has_resident = transient_files.front().records != nullptr;
+        mem_chunk available_mem = available_mem_;
+        if (has_resident) {
+            available_mem = get_mem_around(available_mem_, transient_files.front().mem);
+        }
+        mem_chunk output_buf_mem;
+        available_mem.split_at(MERGE_OUTPUT_BUF_SIZE, output_buf_mem, available_mem);
+
+        input_streams.clear();
+        prefetch.reset();
+        merger.clear();
+
+        size_t mem_fan_in = available_mem.size() / (2 * MERGE_BLOCK_MIN_SIZE);
+        size_t fan_in = std::min(mem_fan_in, files_budget / 2) + has_resident;
+        size_t num_inputs = transient_files.size();
+        if (fan_in < 2 && num_inputs > 1 && files_budget / 2 < mem_fan_in) {
+            throw std::runtime_error("Not enough open files allowed for merge phase");
+        }
+
+        /* the final pass */
+        if (options.merge_threads > 1
+            && !has_resident
+            && num_inputs <= fan_in
+            && merge_partitioned(
+                options, available_mem_, src_file, dest_file, transient_files, read_ahead.get())) {
+            return;
+        }
+
+        /*
+         * Intermediate pass: smallest runs go first (every pass rewrites
+         * the runs merged, a run is rewritten as many times as there are
+         * passes it takes part in).  The first pass merges just enough
+         * runs for every later pass to merge the full fan-in, as in
+         * k-ary Huffman coding.
+         */
+        if (num_inputs > fan_in && fan_in >= 2) {
+            num_inputs = (num_inputs - 2) % (fan_in - 1) + 2;
+            std::stable_sort(
+                transient_files.begin() + has_resident, transient_files.end(),
+                [](const run_file &a, const run_file &b) { return a.size < b.size; });
+        }
+
+        /*
+         * Runs are read by blocks with forecasting: a block per run, the
+         * rest of the memory is the pool shared by the runs (read-ahead
+         * threads load pool blocks in background).
+         */
+        size_t num_runs = std::max<size_t>(1, std::min(num_inputs, fan_in) - has_resident);
+        size_t block_size = std::min(MERGE_BLOCK_MAX_SIZE, available_mem.size() / (2 * num_runs))
+            & ~size_t(mem_chunk::ALIGNMENT_MAX - 1);
+        mem_chunk blocks_mem;
+        available_mem.split_at(num_runs * block_size, blocks_mem, available_mem);
+        /* body files of the runs merged go to the output run */
+        bodies.reset(new body_source(
+            input, std::vector<file_id_t>(),
+            files_budget > num_runs ? files_budget - num_runs : 1));
+        prefetch.reset(new prefetch_pool(
+            available_mem, block_size, read_ahead.get(),
+            [](const uint8_t *a, const uint8_t *b) { return compare_keys(a, b) < 0; }));
+
+        while (num_inputs != 0) {
+            const run_file &run = transient_files.front();
+            std::unique_ptr<run_parser> p;
+            if (!run.records) {
+                if (block_size < MERGE_BLOCK_MIN_SIZE || blocks_mem.size() < block_size) {
+                    break;
+                }
+                mem_chunk block_mem;
+                blocks_mem.split_at(block_size, block_mem, blocks_mem);
+                p.reset(new run_parser(block_mem, run.id, *prefetch, get_forecast(run), run.blocks));
+            }
+            num_inputs--;
+
+            const uint32_t *body_file_map = bodies->add(run.body_files);
+            merge_element e = p
+                ? merge_element(*p, *bodies, body_file_map)
+                : merge_element(run, *bodies, body_file_map);
+            transient_files.pop_front();
+
+            if (e.is_valid()) {
+                merger.push_back(e);
+                input_streams.push_back(std::move(p));
+            }
+        }
+
+        /* a single run left is still to be exported */
+        if (merger.size()<2 && !transient_files.empty()) {
+            throw std::runtime_error("Not enough memory for merge phase");
+        }
+        prefetch->start();
+
+        bool is_final = transient_files.empty();
+        file_id_t output_file_id;
+        run_file *output_run = nullptr;
+        compressed_blocks *output_blocks = nullptr;
+
+        if (is_final) {
+            output_file_id = dest_file;
+        } else {
+            output_file_id = file_id::create_temporary("yndx-xxlsort");
+            transient_files.push_back(run_file(output_file_id, options.compress_runs));
+            output_run = &transient_files.back();
+            output_run->body_files = bodies->get_files();
+            output_blocks = output_run->blocks.get();
+        }
+
+        render_buf output(output_buf_mem, output_file_id, options.write_buffers, output_blocks);
+        merge_streams(options, merger, output, output_run);
     }
 }
 
@@ -414,6 +2033,233 @@ size_t get_available_mem_size()
 }
 
 
+unsigned get_env_unsigned(
+    const char *name, unsigned default_value, unsigned min_value, unsigned max_value)
+{
+    const char *p = getenv(name);
+    if (!p) {
+        return default_value;
+    }
+    char *endp;
+    unsigned long v = strtoul(p, &endp, 10);
+    if (endp == p || *endp || v < min_value || v > max_value) {
+        throw std::runtime_error(
+            format_message("Invalid settings in env: %s=%s", name, p));
+    }
+    return v;
+}
+
+
+/*
+ * SORT_ENGINE    - how segments are sorted in memory: samplesort (the
+ *                  default, comparison based) or radix (MSD radix sort
+ *                  by the key prefix, best for keys with uniformly
+ *                  distributed leading bytes)
+ * RUN_FORMATION  - segments (the default, runs are one memory load each)
+ *                  or replacement (replacement selection, longer runs
+ *                  but no multi-threading and no pipelining)
+ * KEY_COMPARE    - force key comparison implementation (scalar, sse4.2,
+ *                  avx2, avx512); by default the best one supported by
+ *                  the CPU is used
+ * HUGE_PAGES     - back the memory arena with huge pages to reduce TLB
+ *                  misses: thp (madvise(MADV_HUGEPAGE)), 2M or 1G
+ *                  (MAP_HUGETLB, needs pages reserved by the admin);
+ *                  falls back to smaller pages, reports what was
+ *                  obtained.  Disabled by default
+ * NUM_THREADS    - the number of threads to sort with (defaults to the
+ *                  number of CPUs)
+ * SPLIT_PIPELINE - the number of segment regions in split phase; 2 or
+ *                  more enable loading, sorting and writing of segments
+ *                  concurrently (the default is 1, strictly serial)
+ * NUMA           - 1 to spread segment regions over NUMA nodes, with
+ *                  loading and sorting of a segment done on the CPUs of
+ *                  its node (regions per node are set by SPLIT_PIPELINE);
+ *                  regions backed by hugetlb pages (HUGE_PAGES=2M/1G)
+ *                  are not bound, the pages stay where they were reserved
+ * WRITE_BEHIND   - the number of buffers output memory is split into;
+ *                  with 2 or more full buffers are written in background
+ *                  (the default is 1, synchronous writes)
+ * MERGE_THREADS  - the number of key ranges the final merge pass is
+ *                  split into, ranges are merged concurrently and written
+ *                  at their offsets in the output (the default is 1, a
+ *                  single thread); needs a seekable destination
+ * READ_AHEAD     - the number of threads reading merge inputs ahead;
+ *                  merge passes load blocks of the runs forecast to run
+ *                  dry first in background, ranges of the final pass
+ *                  split input buffers in two, one is filled while the
+ *                  other is consumed (disabled by default, blocks are
+ *                  loaded when needed then)
+ * LOOK_AHEAD     - MiB of large record bodies (those left in the input
+ *                  file) requested ahead of time when exporting, the OS
+ *                  reads them in background (64 by default, 0 disables)
+ * COMPRESS       - lz to compress transient files (runs) by blocks with
+ *                  a fast LZ codec, trades CPU for disk bandwidth and
+ *                  space; with WRITE_BEHIND the compression is done in
+ *                  background.  The default is none
+ * RUN_BODIES     - inline (the default) or separate: bodies are written
+ *                  to body files next to the runs, merge passes move the
+ *                  headers only and the final pass gathers the bodies
+ *                  (random reads, as with the bodies left in the input)
+ * KEY_POINTERS   - 1 to leave all bodies in the input file, whatever the
+ *                  size (bodies of 1 MiB and larger are left there
+ *                  anyway): only keys with body positions are sorted and
+ *                  merged, the final pass fetches every body from the
+ *                  input.  Suits large bodies on SSD; has no effect
+ *                  unless the input is seekable
+ */
+sort_options get_sort_options()
+{
+    sort_options options;
+
+    const char *p = getenv("SORT_ENGINE");
+    if (!p || !strcmp(p, "samplesort")) {
+        options.engine = SORT_ENGINE_SAMPLESORT;
+    } else if (!strcmp(p, "radix")) {
+        options.engine = SORT_ENGINE_RADIX;
+    } else {
+        throw std::runtime_error(
+            format_message("Invalid settings in env: SORT_ENGINE=%s", p));
+    }
+
+    p = getenv("RUN_FORMATION");
+    if (!p || !strcmp(p, "segments")) {
+        options.run_formation = RUN_FORMATION_SEGMENTS;
+    } else if (!strcmp(p, "replacement")) {
+        options.run_formation = RUN_FORMATION_REPLACEMENT_SELECTION;
+    } else {
+        throw std::runtime_error(
+            format_message("Invalid settings in env: RUN_FORMATION=%s", p));
+    }
+
+    p = getenv("HUGE_PAGES");
+    if (!p || !strcmp(p, "none")) {
+        options.huge_pages = HUGE_PAGES_NONE;
+    } else if (!strcmp(p, "thp")) {
+        options.huge_pages = HUGE_PAGES_TRANSPARENT;
+    } else if (!strcmp(p, "2M")) {
+        options.huge_pages = HUGE_PAGES_2M;
+    } else if (!strcmp(p, "1G")) {
+        options.huge_pages = HUGE_PAGES_1G;
+    } else {
+        throw std::runtime_error(
+            format_message("Invalid settings in env: HUGE_PAGES=%s", p));
+    }
+
+    p = getenv("NUMA");
+    if (!p || !strcmp(p, "0")) {
+        options.numa = false;
+    } else if (!strcmp(p, "1")) {
+        options.numa = true;
+    } else {
+        throw std::runtime_error(
+            format_message("Invalid settings in env: NUMA=%s", p));
+    }
+
+    p = getenv("COMPRESS");
+    if (!p || !strcmp(p, "none")) {
+        options.compress_runs = false;
+    } else if (!strcmp(p, "lz")) {
+        options.compress_runs = true;
+    } else {
+        throw std::runtime_error(
+            format_message("Invalid settings in env: COMPRESS=%s", p));
+    }
+
+    p = getenv("RUN_BODIES");
+    if (!p || !strcmp(p, "inline")) {
+        options.separate_bodies = false;
+    } else if (!strcmp(p, "separate")) {
+        options.separate_bodies = true;
+    } else {
+        throw std::runtime_error(
+            format_message("Invalid settings in env: RUN_BODIES=%s", p));
+    }
+
+    p = getenv("KEY_POINTERS");
+    if (!p || !strcmp(p, "0")) {
+        options.key_pointers = false;
+    } else if (!strcmp(p, "1")) {
+        options.key_pointers = true;
+    } else {
+        throw std::runtime_error(
+            format_message("Invalid settings in env: KEY_POINTERS=%s", p));
+    }
+
+    options.hugetlb_arena = false;
+
+    p = getenv("KEY_COMPARE");
+    if (p) {
+        select_key_compare(p);
+    }
+
+    options.num_threads = get_env_unsigned(
+        "NUM_THREADS", std::max(1u, std::thread::hardware_concurrency()), 1, 1024);
+    options.split_pipeline_depth = get_env_unsigned("SPLIT_PIPELINE", 1, 1, 16);
+    options.write_buffers = get_env_unsigned("WRITE_BEHIND", 1, 1, 64);
+    options.merge_threads = get_env_unsigned("MERGE_THREADS", 1, 1, 1024);
+    options.read_ahead_threads = get_env_unsigned("READ_AHEAD", 0, 0, 1024);
+    options.look_ahead = file_size_t(get_env_unsigned("LOOK_AHEAD", 64, 0, 1024 * 1024)) * MiB;
+
+    return options;
+}
+
+
+/*
+ * Allocate the memory arena, attempt to get huge pages if requested
+ * falling back to the smaller ones.  Returns the kind of pages obtained,
+ * is_hugetlb tells if they are hugetlb pages.
+ */
+const char *allocate_arena(size_t size, huge_pages_mode huge_pages, void *&p, bool &is_hugetlb)
+{
+    is_hugetlb = false;
+#ifdef MAP_HUGETLB
+    static const struct
+    {
+        huge_pages_mode  mode;
+        int              log_page_size;
+        const char      *name;
+    } hugetlb[] = {
+        { HUGE_PAGES_1G, 30, "1 GiB hugetlb pages" },
+        { HUGE_PAGES_2M, 21, "2 MiB hugetlb pages" }
+    };
+
+    for (const auto &h: hugetlb) {
+        if (huge_pages < h.mode) {
+            continue;
+        }
+        size_t page_size = size_t(1) << h.log_page_size;
+        size_t rounded_size = (size + page_size - 1) & ~(page_size - 1);
+        /* MAP_HUGE_SHIFT is 26, not always defined */
+        int flags = MAP_ANON|MAP_PRIVATE|MAP_HUGETLB|(h.log_page_size << 26);
+        p = mmap(NULL, rounded_size, PROT_READ|PROT_WRITE, flags, -1, 0);
+        if (p != MAP_FAILED) {
+            is_hugetlb = true;
+            return h.name;
+        }
+    }
+#endif
+
+    p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
+    if (p==MAP_FAILED) {
+        throw std::runtime_error(
+            format_message_with_errno(
+                errno,
+                "Allocating %zu bytes of memory", size));
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (huge_pages != HUGE_PAGES_NONE) {
+        if (madvise(p, size, MADV_HUGEPAGE) == 0) {
+            return "transparent huge pages (madvise)";
+        }
+        warn("madvise(MADV_HUGEPAGE)");
+    }
+#endif
+
+    return "regular pages";
+}
+
+
 int main(int argc, char ** argv)
 {
     if (argc != 3) {
@@ -422,15 +2268,14 @@ int main(int argc, char ** argv)
     }
 
     try {
+        sort_options options = get_sort_options();
         size_t size = get_available_mem_size();
-        void *p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
-        if (p==MAP_FAILED) {
-            throw std::runtime_error(
-                format_message_with_errno(
-                    errno,
-                    "Allocating %zu bytes of memory", size));
+        void *p;
+        const char *pages = allocate_arena(size, options.huge_pages, p, options.hugetlb_arena);
+        if (options.huge_pages != HUGE_PAGES_NONE) {
+            fprintf(stderr, "%s: %zu bytes of memory backed by %s\n", argv[0], size, pages);
         }
-        sort_element::base = p;
+        sort_element_base::base = p;
 
         mem_chunk available_mem = mem_chunk(p, size).aligned();
 
@@ -439,9 +2284,9 @@ int main(int argc, char ** argv)
 
         dest_file->set_auto_unlink(true);
 
-        std::deque<file_id_t> transient_files;
-        split_and_sort(available_mem, src_file, dest_file, transient_files);
-        merge_sorted(available_mem, src_file, dest_file, transient_files);
+        std::deque<run_file> transient_files;
+        split_and_sort(options, available_mem, src_file, dest_file, transient_files);
+        merge_sorted(options, available_mem, src_file, dest_file, transient_files);
 
         dest_file->set_auto_unlink(false);
 